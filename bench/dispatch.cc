@@ -0,0 +1,143 @@
+#include "fiber.h"
+
+#include "bt_adapter.h"
+#include "bt_channel.h"
+#include "bt_device.h"
+#include "bt_fake_console.h"
+#include "bt_fake_controller.h"
+
+#include <bluetooth/l2cap.h>
+#include <chrono>
+#include <unordered_map>
+
+// ns per ACL packet: frames written by the fake controller and read,
+// routed to their link and channel and handed to a sync listener by the
+// adapter. then the two lookups on that path, handle to link and cid to
+// channel, done with flat tables the way adapter and device keep them
+// against the std::unordered_map they replaced
+
+static const usize PACKETS = 200000;
+static const usize BATCH = 16;
+static const usize LOOKUPS = 20000000;
+
+static usize delivered = 0;
+static usize wanted = 0;
+static condition arrived;
+
+static double ns_since(std::chrono::steady_clock::time_point start, usize count)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+static void received(block pkt)
+{
+    if (++delivered == wanted)
+        arrived.notify();
+}
+
+static void end_to_end()
+{
+    static bt::fake_controller controller;
+    static bt::adapter hci(bt::adapter::transport{controller.host_fd()});
+    static const bdaddr_t peer = {{0x46, 0xf8, 0x3b, 0xeb, 0x68, 0xdc}};
+
+    if (!hci.reset() || !hci.read_buffer_size())
+        exit(1);
+
+    // answers the l2cap signalling for the two hid psms
+    static bt::fake_console console(controller, peer);
+
+    static bt::device dev(hci, peer);
+    if (!dev.connect(0xcc18, 0x02, 0x00, 0x00))
+        exit(1);
+    dev.connected.wait();
+
+    static bt::channel control(dev);
+    static bt::channel interrupt(dev);
+    if (!dev.connect(control, 0x11) || !dev.connect(interrupt, 0x13))
+        exit(1);
+
+    emitter<block>::listener control_frames(received, true);
+    emitter<block>::listener interrupt_frames(received, true);
+    control.data.listen(control_frames);
+    interrupt.data.listen(interrupt_frames);
+
+    // a fresh device hands out cids from 0x0040 in order
+    u8 frames[2][sizeof(l2cap_hdr) + 48] = {};
+    for (u16 i = 0; i < 2; ++i)
+    {
+        auto hdr = (l2cap_hdr *)frames[i];
+        hdr->len = htobs(48);
+        hdr->cid = htobs(0x0040 + i);
+    }
+
+    auto handle = controller.link(peer);
+    auto start = std::chrono::steady_clock::now();
+    for (usize sent = 0; sent < PACKETS; sent += BATCH)
+    {
+        wanted = sent + BATCH;
+        for (usize i = 0; i < BATCH; ++i)
+            controller.send_acl(handle, block(frames[i & 1], sizeof(frames[i & 1])));
+
+        while (delivered < wanted)
+            arrived.wait();
+    }
+
+    printf("dispatch end to end:     %7.1f ns per acl packet\n", ns_since(start, PACKETS));
+}
+
+// 8 links of 4 channels, looked up in turn
+struct flat_link
+{
+    usize channels[64];
+};
+
+static void lookups()
+{
+    static flat_link *connections[0x1000] = {};
+    static flat_link links[8];
+    std::unordered_map<u16, std::unordered_map<u16, usize>> mapped;
+
+    u16 handles[8], cids[4] = {0x0040, 0x0041, 0x0042, 0x0043};
+    for (usize i = 0; i < 8; ++i)
+    {
+        handles[i] = 0x0001 + i * 3;
+        connections[handles[i]] = &links[i];
+        for (usize k = 0; k < 4; ++k)
+        {
+            links[i].channels[cids[k] % 64] = i * 4 + k;
+            mapped[handles[i]][cids[k]] = i * 4 + k;
+        }
+    }
+
+    volatile usize sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (usize n = 0; n < LOOKUPS; ++n)
+    {
+        auto link = connections[handles[n & 7] & 0xFFF];
+        sink = sink + link->channels[cids[(n >> 3) & 3] % 64];
+    }
+    printf("lookup flat tables:      %7.1f ns per acl packet\n", ns_since(start, LOOKUPS));
+
+    start = std::chrono::steady_clock::now();
+    for (usize n = 0; n < LOOKUPS; ++n)
+    {
+        auto link = mapped.find(handles[n & 7]);
+        sink = sink + link->second.find(cids[(n >> 3) & 3])->second;
+    }
+    printf("lookup unordered_map:    %7.1f ns per acl packet\n", ns_since(start, LOOKUPS));
+}
+
+int main()
+{
+    lookups();
+
+    fiber::create("dispatch", [] {
+        end_to_end();
+        exit(0);
+    });
+
+    while (true)
+        fiber::run();
+}
@@ -0,0 +1,106 @@
+#include "fiber.h"
+
+#include <chrono>
+#include <memory>
+
+// emitter::emit against the number of listeners, for sync listeners that
+// run inline, listeners that get a fiber each and fibers waiting in next.
+// the emitting fiber yields after every emit so whatever it woke has run,
+// the 0 row is the cost of that loop alone. allocations are counted by
+// replacing the global operator new
+
+static const usize EMITS = 100000;
+
+static usize allocations = 0;
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    if (auto ptr = malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+enum class kind
+{
+    sync,
+    fiber,
+    next,
+};
+
+static const char *names[] = {"sync", "fiber", "next"};
+
+static emitter<block> source;
+static usize received = 0;
+static bool done = false;
+
+static void measure(kind type, usize count)
+{
+    // waiters stay parked in next from one measurement to the next
+    for (auto i = source.listening(); type == kind::next && i < count; ++i)
+    {
+        fiber::create("next", [] {
+            while (true)
+            {
+                block pkt;
+                source.next(&pkt);
+                received += pkt.size;
+            }
+        }, 16 * 1024);
+    }
+
+    std::vector<std::unique_ptr<emitter<block>::listener>> listeners;
+    for (usize i = 0; type != kind::next && i < count; ++i)
+    {
+        listeners.emplace_back(new emitter<block>::listener([](block pkt) { received += pkt.size; },
+                                                            type == kind::sync));
+        source.listen(*listeners.back());
+    }
+
+    static kind current;
+    static usize listening;
+    current = type;
+    listening = count;
+    done = false;
+
+    fiber::create("emit", [] {
+        static const u8 data[4] = {};
+
+        // warm up the context pool and the stats entries
+        for (usize i = 0; i < 100; ++i)
+        {
+            source.emit(block(data, sizeof(data)));
+            fiber::delay(0);
+        }
+
+        auto before = allocations;
+        auto start = std::chrono::steady_clock::now();
+        for (usize i = 0; i < EMITS; ++i)
+        {
+            source.emit(block(data, sizeof(data)));
+            fiber::delay(0);
+        }
+
+        auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        printf("emit %-5s %3zu listeners: %8.1f ns per emit, %5.2f allocations per emit\n", names[(int)current],
+               listening, ns / EMITS, (double)(allocations - before) / EMITS);
+        done = true;
+    }, 64 * 1024);
+
+    while (!done)
+        fiber::run();
+}
+
+int main()
+{
+    measure(kind::sync, 0);
+
+    for (auto type : {kind::sync, kind::fiber, kind::next})
+    {
+        for (usize count : {1, 4, 16, 64})
+            measure(type, count);
+    }
+}
@@ -0,0 +1,56 @@
+#include "fiber.h"
+
+#include <chrono>
+#include <thread>
+
+// fiber::input under contention: N producer threads queue callables on the
+// main thread's scheduler as fast as they can while it drains them. the
+// producer counts can be given as arguments
+
+static const usize INPUTS = 400000;
+
+static usize consumed = 0;
+
+static void measure(usize producers)
+{
+    auto each = INPUTS / producers;
+    auto total = each * producers;
+    consumed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (usize i = 0; i < producers; ++i)
+    {
+        threads.emplace_back([each] {
+            for (usize n = 0; n < each; ++n)
+                fiber::input([] { ++consumed; });
+        });
+    }
+
+    while (consumed < total)
+        fiber::run();
+
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    for (auto &thread : threads)
+        thread.join();
+
+    printf("input %2zu producers: %7.1f ns per input, %6.2f M inputs/s\n", producers, elapsed / total,
+           total / elapsed * 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    // the first scheduler is the one fiber::input targets
+    fiber::self();
+
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; ++i)
+            measure(std::max(1, atoi(argv[i])));
+        return 0;
+    }
+
+    for (usize producers : {1, 2, 4, 8})
+        measure(producers);
+}
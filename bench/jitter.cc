@@ -0,0 +1,96 @@
+#include "fiber.h"
+
+#include <algorithm>
+#include <chrono>
+
+// how late a periodic fiber wakes, paced by relative delays like the input
+// loop used to be, by delay_until against absolute deadlines, and by
+// delay_until spinning out the last stretch. lateness for delay is measured
+// from the previous wakeup, the others from the deadline. the spins can be
+// given in us as arguments
+
+static const usize WAKEUPS = 500;
+static const usize PERIOD_MS = 3;
+
+static const double BUCKETS[] = {1, 10, 50, 100, 250, 500, 1000};
+static const usize BUCKET_COUNT = sizeof(BUCKETS) / sizeof(BUCKETS[0]);
+
+static std::vector<double> late;
+static bool done = false;
+
+static double since(fiber::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(fiber::now() - start).count();
+}
+
+static void report(const char *name)
+{
+    std::sort(late.begin(), late.end());
+
+    usize counts[BUCKET_COUNT + 1] = {};
+    for (auto us : late)
+        ++counts[std::upper_bound(BUCKETS, BUCKETS + BUCKET_COUNT, us) - BUCKETS];
+
+    printf("jitter %-27s p50 %7.1f p99 %7.1f max %7.1f us |", name, late[late.size() / 2],
+           late[late.size() * 99 / 100], late.back());
+    for (usize i = 0; i < BUCKET_COUNT; ++i)
+        printf(" <%g:%zu", BUCKETS[i], counts[i]);
+    printf(" >=%g:%zu\n", BUCKETS[BUCKET_COUNT - 1], counts[BUCKET_COUNT]);
+}
+
+static void measure(const char *name, const std::function<void()> &pacer)
+{
+    late.clear();
+    done = false;
+
+    fiber::create("pacer", [pacer] {
+        pacer();
+        done = true;
+    }, 64 * 1024);
+
+    while (!done)
+        fiber::run();
+
+    report(name);
+}
+
+static void relative()
+{
+    measure("delay", [] {
+        for (usize n = 0; n < WAKEUPS; ++n)
+        {
+            auto start = fiber::now();
+            fiber::delay(PERIOD_MS);
+            late.push_back(since(start) - PERIOD_MS * 1000.0);
+        }
+    });
+}
+
+static void absolute(usize spin_us)
+{
+    auto name = "delay_until, " + std::to_string(spin_us) + " us spin";
+    measure(name.c_str(), [spin_us] {
+        auto due = fiber::now();
+        for (usize n = 0; n < WAKEUPS; ++n)
+        {
+            due += std::chrono::milliseconds(PERIOD_MS);
+            fiber::delay_until(due, spin_us);
+            late.push_back(since(due));
+        }
+    });
+}
+
+int main(int argc, char **argv)
+{
+    relative();
+
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; ++i)
+            absolute(std::max(0, atoi(argv[i])));
+        return 0;
+    }
+
+    for (usize spin_us : {0, 100, 200})
+        absolute(spin_us);
+}
@@ -0,0 +1,107 @@
+#include "fiber.h"
+
+#include <algorithm>
+#include <chrono>
+
+// how late a periodic fiber like fake_pro's input loop wakes while normal
+// fibers keep the thread busy, created normal and then high. the busy
+// fibers either wake every ms for a stretch of work, or pass a token round
+// so one of them is always ready
+
+static const usize WAKEUPS = 500;
+static const usize PERIOD_MS = 4;
+static const usize BUSY_FIBERS = 8;
+
+enum class load
+{
+    burst,
+    ring,
+};
+
+static std::vector<double> late;
+// run only returns once nothing is ready, so the input loop stops the busy
+// fibers itself when it's done
+static bool stopping = false;
+static usize busy = 0;
+static condition ring[BUSY_FIBERS];
+
+static void work(usize us)
+{
+    auto end = fiber::now() + std::chrono::microseconds(us);
+    while (fiber::now() < end)
+        ;
+}
+
+static void start_load(load type)
+{
+    stopping = false;
+
+    for (usize i = 0; i < BUSY_FIBERS; ++i)
+    {
+        ++busy;
+        fiber::create("busy", [type, i] {
+            while (!stopping)
+            {
+                if (type == load::ring)
+                {
+                    ring[i].wait();
+                    work(200);
+                    ring[(i + 1) % BUSY_FIBERS].notify();
+                }
+                else
+                {
+                    fiber::delay(1);
+                    work(300);
+                }
+            }
+
+            --busy;
+        }, 64 * 1024);
+    }
+
+    if (type == load::ring)
+        ring[0].notify();
+}
+
+static void drain_load()
+{
+    while (busy != 0)
+    {
+        for (auto &cv : ring)
+            cv.notify();
+        fiber::run();
+    }
+}
+
+static void measure(load type, fiber::priority prio)
+{
+    late.clear();
+    start_load(type);
+
+    fiber::create("input loop", [] {
+        auto due = fiber::now();
+        for (usize n = 0; n < WAKEUPS; ++n)
+        {
+            due += std::chrono::milliseconds(PERIOD_MS);
+            fiber::delay_until(due);
+            late.push_back(std::chrono::duration<double, std::micro>(fiber::now() - due).count());
+        }
+        stopping = true;
+    }, 64 * 1024, prio);
+
+    drain_load();
+
+    std::sort(late.begin(), late.end());
+    printf("priority %-5s input loop %-6s: p50 %7.1f p99 %7.1f max %7.1f us late\n",
+           type == load::ring ? "ring" : "burst", prio == fiber::priority::high ? "high" : "normal",
+           late[late.size() / 2], late[late.size() * 99 / 100], late.back());
+}
+
+int main()
+{
+    for (auto type : {load::burst, load::ring})
+    {
+        for (auto prio : {fiber::priority::normal, fiber::priority::high})
+            measure(type, prio);
+    }
+}
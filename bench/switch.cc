@@ -0,0 +1,147 @@
+#include "fiber.h"
+
+#include <chrono>
+#include <unistd.h>
+
+// ns per fiber switch: two fibers handing conditions back and forth, two
+// switches per round trip, then the same between two asyncs. built once
+// per backend, switch_ucontext has FIBER_UCONTEXT defined for fiber.cc and
+// this file alike. the footprint rows park a few thousand idle connection
+// loops, as fibers with the 64 KiB stacks the channel pipes used and as
+// asyncs, and divide what the process grew by
+
+#ifdef FIBER_UCONTEXT
+static const char *BACKEND = "setjmp/ucontext";
+#else
+static const char *BACKEND = "fiber_switch";
+#endif
+
+static const usize ROUND_TRIPS = 2000000;
+static const usize CREATES = 200000;
+static const usize CONNECTIONS = 4000;
+
+static condition ping, pong;
+static condition idle;
+static bool done = false;
+
+static double ns_since(std::chrono::steady_clock::time_point start, usize count)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+static fiber::async async_pong()
+{
+    while (true)
+    {
+        co_await ping;
+        pong.notify();
+    }
+}
+
+static fiber::async async_ping()
+{
+    for (usize i = 0; i < 1000; ++i)
+    {
+        ping.notify();
+        co_await pong;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (usize i = 0; i < ROUND_TRIPS; ++i)
+    {
+        ping.notify();
+        co_await pong;
+    }
+    printf("%-16s async:  %6.1f ns\n", BACKEND, ns_since(start, ROUND_TRIPS * 2));
+
+    done = true;
+}
+
+static fiber::async async_connection()
+{
+    while (true)
+        co_await idle;
+}
+
+// mapped and resident bytes of the whole process
+static void memory(usize *mapped, usize *resident)
+{
+    usize pages[2] = {};
+    auto statm = fopen("/proc/self/statm", "r");
+    if (statm == nullptr || fscanf(statm, "%zu %zu", &pages[0], &pages[1]) != 2)
+        error("failed to read /proc/self/statm");
+    fclose(statm);
+
+    *mapped = pages[0] * sysconf(_SC_PAGESIZE);
+    *resident = pages[1] * sysconf(_SC_PAGESIZE);
+}
+
+static void footprint(const char *kind, void (*connect)())
+{
+    usize mapped, resident;
+    memory(&mapped, &resident);
+
+    for (usize i = 0; i < CONNECTIONS; ++i)
+        connect();
+
+    usize mapped_after, resident_after;
+    memory(&mapped_after, &resident_after);
+
+    printf("%-16s %-5s footprint: %6.2f KiB resident, %6.1f KiB mapped per connection\n", BACKEND, kind,
+           (resident_after - resident) / 1024.0 / CONNECTIONS, (mapped_after - mapped) / 1024.0 / CONNECTIONS);
+}
+
+int main()
+{
+    fiber::create("pong", [] {
+        while (true)
+        {
+            ping.wait();
+            pong.notify();
+        }
+    }, 16 * 1024);
+
+    fiber::create("ping", [] {
+        // a few rounds first so both stacks are paged in
+        for (usize i = 0; i < 1000; ++i)
+        {
+            ping.notify();
+            pong.wait();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (usize i = 0; i < ROUND_TRIPS; ++i)
+        {
+            ping.notify();
+            pong.wait();
+        }
+        printf("%-16s switch: %6.1f ns\n", BACKEND, ns_since(start, ROUND_TRIPS * 2));
+
+        // a fiber that returns at once, create switches into it and back
+        start = std::chrono::steady_clock::now();
+        for (usize i = 0; i < CREATES; ++i)
+            fiber::create("empty", [] {}, 16 * 1024);
+        printf("%-16s create: %6.1f ns\n", BACKEND, ns_since(start, CREATES));
+
+        done = true;
+    }, 16 * 1024);
+
+    while (!done)
+        fiber::run();
+
+    // pong stays parked in ping, and the asyncs wait on the same pair
+    done = false;
+    fiber::spawn("pong", async_pong());
+    fiber::spawn("ping", async_ping());
+
+    while (!done)
+        fiber::run();
+
+    footprint("fiber", [] {
+        fiber::create("connection", [] {
+            while (true)
+                idle.wait();
+        }, 64 * 1024);
+    });
+    footprint("async", [] { fiber::spawn("connection", async_connection()); });
+}
@@ -0,0 +1,74 @@
+#include "fiber.h"
+
+#include "bt_adapter.h"
+#include "bt_fake_controller.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// throughput as adapters are added, one fiber::worker each. every worker
+// owns a fake controller and an adapter on top of it and runs HCI command
+// round trips through them. the adapter counts can be given as arguments
+
+static const usize COMMANDS = 20000;
+
+static std::atomic<usize> ready(0);
+static std::atomic<usize> finished(0);
+static std::atomic<bool> go(false);
+
+static void adapter_worker()
+{
+    bt::fake_controller controller;
+    bt::adapter hci(bt::adapter::transport{controller.host_fd()});
+    hci.reset();
+
+    ++ready;
+    while (!go)
+        fiber::delay(1);
+
+    for (usize i = 0; i < COMMANDS; ++i)
+        hci.read_local_version();
+
+    ++finished;
+}
+
+static void measure(usize adapters)
+{
+    ready = 0;
+    finished = 0;
+    go = false;
+
+    for (usize i = 0; i < adapters; ++i)
+        fiber::worker("adapter " + std::to_string(i), adapter_worker);
+
+    while (ready < adapters)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+
+    while (finished < adapters)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto total = adapters * COMMANDS / elapsed;
+    printf("workers %2zu adapters: %7.1f k commands/s, %7.1f k per adapter\n", adapters, total / 1e3,
+           total / adapters / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    printf("workers on %u cores\n", std::thread::hardware_concurrency());
+
+    // workers are never stopped, so each measurement adds new ones
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; ++i)
+            measure(std::max(1, atoi(argv[i])));
+        return 0;
+    }
+
+    for (usize adapters : {1, 2, 4, 8})
+        measure(adapters);
+}
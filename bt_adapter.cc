@@ -2,19 +2,23 @@
 
 #include "bt_device.h"
 #include "bt_command.h"
-
-#include <thread>
+#include "bt_snoop.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 
 namespace bt
 {
 
-void valid_status(const u8 *status)
+bool valid_status(const u8 *status)
 {
+    if (status == nullptr)
+        return false;
+
     switch (*status)
     {
-    case 0x00: return;
+    case 0x00: return true;
     default:
         throw std::runtime_error(std::string("request failed: ") + std::to_string(*status));
     }
@@ -33,49 +37,249 @@ adapter::adapter(int num)
         return;
     }
 
-    std::thread([this] { feed(); }).detach();
-    fiber::create("adapter", [this] { run(); });
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    start();
+}
+
+adapter::adapter(transport io) : fd(io.fd)
+{
+    int type;
+    socklen_t size = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &size) < 0 || type == SOCK_STREAM)
+        stream = true;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    start();
+}
+
+void adapter::start()
+{
+    spawn("hci", &adapter::feed, 64 * 1024);
+    spawn("hci writer", &adapter::write_backlog, 64 * 1024);
+    spawn("adapter", &adapter::run);
+}
+
+void adapter::spawn(const char *name, void (adapter::*body)(), usize stack_size)
+{
+    ++running;
+    fiber::create(name, [this, body] {
+        (this->*body)();
+        if (--running == 0)
+            stopped.notify();
+    }, stack_size);
 }
 
 adapter::~adapter()
 {
+    // none of the fibers can run again
+    if (!fiber::alive())
+    {
+        close(fd);
+        return;
+    }
+
+    closing = true;
+    fiber::wake(fd);
+    recv_ready.notify();
+    recv_freed.notify();
+    tx_backlogged.notify();
+
+    while (running != 0)
+    {
+        if (fiber::inside())
+            stopped.wait();
+        else
+            fiber::run();
+    }
+
+    fiber::forget(fd);
     close(fd);
 }
 
+// linear probing from the opcode's home slot, a free slot ends the search
+adapter::command_queue *adapter::queue_of(u16 opcode, bool create)
+{
+    auto index = (opcode * 0x9E37u >> 8) % COMMAND_SLOTS;
+    for (usize probe = 0; probe < COMMAND_SLOTS; ++probe)
+    {
+        auto &queue = commands[(index + probe) % COMMAND_SLOTS];
+        if (queue.used)
+        {
+            if (queue.opcode == opcode)
+                return &queue;
+            continue;
+        }
+
+        if (!create)
+            return nullptr;
+
+        queue = {opcode, true, nullptr, 0, 0};
+        return &queue;
+    }
+
+    if (create)
+    {
+        errno = ENOSPC;
+        error("too many command opcodes");
+    }
+
+    return nullptr;
+}
+
 void adapter::attach(command &cmd)
 {
-    commands.emplace(cmd.opcode, cmd);
+    auto &queue = *queue_of(cmd.opcode, true);
+    cmd.sequence = ++queue.sent;
+    cmd.next = nullptr;
+
+    auto link = &queue.head;
+    while (*link != nullptr)
+        link = &(*link)->next;
+    *link = &cmd;
 }
 
 void adapter::attach(device &dev)
 {
     devices.emplace(dev.addr, dev);
     if (dev.handle != 0)
-        connections.emplace(dev.handle, dev);
+        connections[btohs(dev.handle) & 0xFFF] = &dev;
 }
 
+// the queue itself is kept, an abandoned command still has an answer on
+// the way that must not be handed to a later one
 void adapter::detach(command &cmd)
 {
-    commands.erase(cmd.opcode);
+    auto queue = queue_of(cmd.opcode, false);
+    if (queue == nullptr)
+        return;
+
+    for (auto link = &queue->head; *link != nullptr; link = &(*link)->next)
+    {
+        if (*link == &cmd)
+        {
+            *link = cmd.next;
+            cmd.next = nullptr;
+            return;
+        }
+    }
+}
+
+bool adapter::submit(command &cmd, fiber::time_point deadline)
+{
+    // sending it again before the first answer arrived abandons that one
+    detach(cmd);
+
+    while (command_credits == 0)
+    {
+        if (!credits_changed.wait_until(deadline))
+            return false;
+    }
+
+    --command_credits;
+    attach(cmd);
+
+    iovec part = {cmd.buffer, cmd.size};
+    send(&part, 1);
+    return true;
+}
+
+// a command whose answer never came. the controller lost it or the event,
+// either way the credit it took and its place in the sequence aren't
+// coming back, so both are given up here or every later command would
+// wait on them. an answer that is only late resets the credits anyway
+void adapter::abandon(command &cmd)
+{
+    detach(cmd);
+
+    auto queue = queue_of(cmd.opcode, false);
+    if (queue != nullptr && queue->answered < cmd.sequence)
+        queue->answered = cmd.sequence;
+
+    ++command_credits;
+    credits_changed.notify();
+}
+
+command *adapter::answer(u16 opcode, u8 credits)
+{
+    command_credits = credits;
+    if (credits != 0)
+        credits_changed.notify();
+
+    auto entry = queue_of(opcode, false);
+    if (entry == nullptr)
+        return nullptr;
+
+    auto &queue = *entry;
+    if (queue.answered == queue.sent)
+        return nullptr;
+
+    // anything else was abandoned before its answer arrived
+    auto sequence = ++queue.answered;
+    auto cmd = queue.head;
+    if (cmd == nullptr || cmd->sequence != sequence)
+        return nullptr;
+
+    queue.head = cmd->next;
+    cmd->next = nullptr;
+    return cmd;
 }
 
 void adapter::detach(device &dev)
 {
+    unschedule(dev);
     devices.erase(dev.addr);
-    if (dev.handle != 0)
-        connections.erase(dev.handle);
+    if (dev.handle != 0 && connection(dev.handle) == &dev)
+        connections[btohs(dev.handle) & 0xFFF] = nullptr;
+}
+
+void adapter::capture(const char *path)
+{
+    capture_log = std::make_unique<snoop>(path);
 }
 
 void adapter::feed()
 {
-    while (true)
+    while (!closing)
     {
-        int result = ::read(fd, recv_buffer, sizeof(recv_buffer));
+        fiber::wait_readable(fd);
+        if (closing)
+            return;
+
+        // readiness is only reported from a poll, which happens once every
+        // ready fiber has run, so whatever an earlier dispatch woke is done
+        // with its packet unless it retained it
+        for (; retired != 0; retired &= retired - 1)
+            --recv_slots[__builtin_ctz(retired)].refs;
+
+        for (auto rx : rx_retired)
+            --rx->refs;
+        rx_retired.clear();
+
+        auto &slot = recv_slots[received % RECV_SLOTS];
+        if (slot.refs != 0)
+        {
+            recv_freed.wait();
+            continue;
+        }
+
+        int result = read_packet(slot.data);
+        if (closing)
+            return;
+
         if (result > 0)
         {
             // printf("read %d\n", result);
-            handled = false;
-            fiber::input([&] { recv.emit(result); });
+            if (capture_log)
+                capture_log->record(true, slot.data, result);
+
+            slot.refs = 1;
+            slot.size = result;
+            ++received;
+            recv_ready.notify();
+        }
+        else if (result < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+            continue;
         }
         else
         {
@@ -84,47 +288,268 @@ void adapter::feed()
     }
 }
 
-void adapter::send(usize size)
+// sized like recv_slot::data
+int adapter::read_packet(u8 *out)
 {
-    while (write(fd, send_buffer, size) < 0)
+    if (!stream)
+        return ::read(fd, out, HCI_MAX_FRAME_SIZE);
+
+    usize header = 0;
+    if (!read_exact(out, 1))
+        return 0;
+
+    switch (out[0])
     {
-        perror("write failed");
-        if (errno == EAGAIN || errno == EINTR)
-            continue;
-        error("failed to write");
+    case HCI_EVENT_PKT: header = sizeof(hci_event_hdr); break;
+    case HCI_ACLDATA_PKT: header = sizeof(hci_acl_hdr); break;
+    case HCI_SCODATA_PKT: header = sizeof(hci_sco_hdr); break;
+    default:
+        errno = EPROTO;
+        error("unknown packet type " + to_hex(out[0], 2));
+    }
+
+    if (!read_exact(out + 1, header))
+        return 0;
+
+    usize length;
+    if (out[0] == HCI_ACLDATA_PKT)
+        length = btohs(((hci_acl_hdr *)(out + 1))->dlen);
+    else
+        length = out[header];
+
+    if (1 + header + length > HCI_MAX_FRAME_SIZE)
+    {
+        errno = EMSGSIZE;
+        error("packet too large");
     }
+
+    if (!read_exact(out + 1 + header, length))
+        return 0;
+
+    return 1 + header + length;
 }
 
-void adapter::run()
+bool adapter::read_exact(u8 *out, usize size)
+{
+    while (size > 0)
+    {
+        auto result = ::read(fd, out, size);
+        if (result > 0)
+        {
+            out += result;
+            size -= result;
+        }
+        else if (result == 0)
+        {
+            errno = ECONNRESET;
+            error("transport closed");
+        }
+        else if (errno == EAGAIN)
+        {
+            fiber::wait_readable(fd);
+            if (closing)
+                return false;
+        }
+        else if (errno != EINTR)
+            error("read failed");
+    }
+
+    return true;
+}
+
+void adapter::send(const iovec *parts, usize count)
 {
-    static usize available = 0;
+    if (capture_log)
+        capture_log->record(false, parts, count);
 
-    ++available;
+    usize size = 0;
+    for (usize i = 0; i < count; ++i)
+        size += parts[i].iov_len;
 
-    while (available < 3)
+    // nothing may overtake what's already waiting
+    usize written = 0;
+    if (tx_backlog.empty())
     {
-        usize size;
-        recv.next(&size);
+        auto result = writev(fd, parts, count);
+        if (result >= 0 && (usize)result == size)
+            return;
 
-        if (handled)
-            continue;
+        if (result > 0)
+            written = result;
+        else if (result == 0)
+        {
+            errno = ECONNRESET;
+            error("transport closed");
+        }
+        else if (errno != EAGAIN && errno != EINTR)
+            error("failed to write");
+    }
+
+    auto &pkt = tx_backlog.emplace_back();
+    pkt.reserve(size - written);
+    for (usize i = 0; i < count; ++i)
+    {
+        auto data = (const u8 *)parts[i].iov_base;
+        auto skip = std::min(written, parts[i].iov_len);
+        pkt.insert(pkt.end(), data + skip, data + parts[i].iov_len);
+        written -= skip;
+    }
 
-        handled = true;
+    tx_backlogged.notify();
+}
+
+void adapter::write_backlog()
+{
+    while (true)
+    {
+        while (!closing && tx_backlog.empty())
+            tx_backlogged.wait();
+
+        if (closing)
+            return;
+
+        fiber::wait_writable(fd);
+        if (closing)
+            return;
+
+        while (!tx_backlog.empty())
+        {
+            auto &pkt = tx_backlog.front();
+            auto result = ::write(fd, pkt.data() + tx_offset, pkt.size() - tx_offset);
+            if (result < 0)
+            {
+                if (errno == EAGAIN)
+                    break;
+                if (errno == EINTR)
+                    continue;
+                error("failed to write");
+            }
+            else if (result == 0)
+            {
+                errno = ECONNRESET;
+                error("transport closed");
+            }
+
+            tx_offset += result;
+            if (tx_offset < pkt.size())
+                continue;
+
+            tx_backlog.pop_front();
+            tx_offset = 0;
+        }
+    }
+}
+
+void adapter::schedule(device &dev)
+{
+    if (dev.tx_scheduled)
+        return;
+
+    dev.tx_scheduled = true;
+    dev.tx_next = nullptr;
+    *tx_ready_tail = &dev;
+    tx_ready_tail = &dev.tx_next;
+}
 
-        if (size == 0)
+void adapter::unschedule(device &dev)
+{
+    if (!dev.tx_scheduled)
+        return;
+
+    dev.tx_scheduled = false;
+    for (auto link = &tx_ready; *link != nullptr; link = &(*link)->tx_next)
+    {
+        if (*link == &dev)
+        {
+            *link = dev.tx_next;
+            break;
+        }
+    }
+
+    tx_ready_tail = &tx_ready;
+    while (*tx_ready_tail != nullptr)
+        tx_ready_tail = &(*tx_ready_tail)->tx_next;
+}
+
+// a busy link only gets one buffer before the next link's turn, so links
+// share the controller fairly and each sends its frames in order
+void adapter::flush()
+{
+    while (acl_free != 0 && tx_ready != nullptr)
+    {
+        auto dev = tx_ready;
+        tx_ready = dev->tx_next;
+        if (tx_ready == nullptr)
+            tx_ready_tail = &tx_ready;
+        dev->tx_scheduled = false;
+
+        --acl_free;
+        if (dev->send_next())
+            schedule(*dev);
+    }
+}
+
+u16 *adapter::refs_of(const block &pkt)
+{
+    if (pkt.data == nullptr)
+        return nullptr;
+
+    auto base = (const u8 *)recv_slots;
+    if (pkt.data >= base && pkt.data < base + sizeof(recv_slots))
+        return &recv_slots[(pkt.data - base) / sizeof(recv_slot)].refs;
+
+    for (auto &rx : rx_buffers)
+    {
+        if (pkt.data >= rx.data.data() && pkt.data <= rx.data.data() + rx.data.size())
+            return &rx.refs;
+    }
+
+    return nullptr;
+}
+
+void adapter::retain(const block &pkt)
+{
+    auto refs = refs_of(pkt);
+    if (refs != nullptr)
+        ++*refs;
+}
+
+void adapter::release(const block &pkt)
+{
+    auto refs = refs_of(pkt);
+    if (refs != nullptr && --*refs == 0)
+        recv_freed.notify();
+}
+
+// handlers may block, so packets are dispatched by a pool of fibers. one
+// is always left idle so the next packet never waits on an earlier one
+void adapter::run()
+{
+    ++idle;
+
+    while (!closing && idle <= MAX_IDLE_DISPATCHERS)
+    {
+        if (dispatched == received)
+        {
+            recv_ready.wait();
             continue;
+        }
+
+        auto index = dispatched++ % RECV_SLOTS;
+        auto &slot = recv_slots[index];
 
-        --available;
+        if (--idle == 0)
+            spawn("adapter", &adapter::run);
 
-        if (available == 0)
-            fiber::create("adapter", [this] { run(); });
+        dispatch(block(slot.data, slot.size));
 
-        dispatch(block(recv_buffer, size));
+        retired |= 1u << index;
+        recv_freed.notify();
 
-        ++available;
+        ++idle;
     }
 
-    --available;
+    --idle;
 }
 
 void adapter::dispatch(block pkt)
@@ -218,12 +643,11 @@ void adapter::dispatch(block pkt)
         if (!hdr)
             return;
 
-        auto handle = htobs(btohs(hdr->handle) & 0xFFF);
-        auto dev = connections.find(handle);
-        if (dev == connections.end())
+        auto dev = connection(hdr->handle);
+        if (dev == nullptr)
             return;
 
-        dev->second.acldata(pkt);
+        reassemble(*dev, (btohs(hdr->handle) >> 12) & 0x3, pkt);
     }
     else if (type == HCI_EVENT_PKT)
     {
@@ -238,24 +662,28 @@ void adapter::dispatch(block pkt)
         case EVT_CMD_COMPLETE:
         {
             auto evt = pkt.advance<evt_cmd_complete>();
+            if (!evt)
+                return;
             // printf("complete %x\n", btohs(evt->opcode));
-            auto cmd = commands.find(btohs(evt->opcode));
-            if (cmd == commands.end())
+            auto cmd = answer(btohs(evt->opcode), evt->ncmd);
+            if (cmd == nullptr)
                 return;
 
-            cmd->second.result.emit(pkt);
+            cmd->result.emit(pkt);
             break;
         }
 
         case EVT_CMD_STATUS:
         {
             auto evt = pkt.advance<evt_cmd_status>();
+            if (!evt)
+                return;
             // printf("status %x\n", btohs(evt->opcode));
-            auto cmd = commands.find(btohs(evt->opcode));
-            if (cmd == commands.end())
+            auto cmd = answer(btohs(evt->opcode), evt->ncmd);
+            if (cmd == nullptr)
                 return;
 
-            cmd->second.result.emit(block(&evt->status, 1));
+            cmd->result.emit(block(&evt->status, 1));
             break;
         }
 
@@ -263,7 +691,7 @@ void adapter::dispatch(block pkt)
         case EVT_INQUIRY_RESULT_WITH_RSSI:
         case EVT_EXTENDED_INQUIRY_RESULT:
         {
-            inquiry_result.emit(pkt);
+            inquiry(hdr->evt, pkt);
             break;
         }
 
@@ -274,16 +702,20 @@ void adapter::dispatch(block pkt)
             auto pkt_counts = ((u16 *)pkt.data) + count;
             for (auto i = 0; i < count; ++i)
             {
-                auto dev = connections.find(handles[i]);
-                if (dev == connections.end())
+                auto dev = connection(handles[i]);
+                if (dev == nullptr)
                 {
                     printf("connection not found %04x\n", handles[i]);
                     continue;
                 }
 
-                dev->second.full_slots -= btohs(pkt_counts[i]);
-                dev->second.slots_changed.notify();
+                auto completed = std::min(btohs(pkt_counts[i]), dev->in_flight);
+                dev->in_flight -= completed;
+                acl_free += completed;
             }
+
+            flush();
+            acl_freed.notify();
             break;
         }
 
@@ -302,7 +734,218 @@ void adapter::dispatch(block pkt)
     }
 }
 
-void adapter::start_inquiry(u32 lap, u8 length, u8 num_rsp)
+// zero while the l2cap header itself is still incomplete
+static usize frame_length(const u8 *data, usize size)
+{
+    if (size < sizeof(l2cap_hdr))
+        return 0;
+
+    return sizeof(l2cap_hdr) + btohs(((const l2cap_hdr *)data)->len);
+}
+
+// frames that arrive in one piece are handed over in place, longer ones
+// are gathered into a pooled buffer until the length in their l2cap header
+// is reached
+void adapter::reassemble(device &dev, u16 boundary, block pkt)
+{
+    auto rx = dev.rx;
+
+    if (boundary == ACL_CONT)
+    {
+        if (rx == nullptr)
+            return;
+
+        rx->data.insert(rx->data.end(), pkt.data, pkt.data + pkt.size);
+        if (rx->expected == 0)
+            rx->expected = frame_length(rx->data.data(), rx->data.size());
+
+        if (rx->expected == 0 || rx->data.size() < rx->expected)
+            return;
+
+        dev.rx = nullptr;
+
+        if (rx->data.size() > rx->expected)
+        {
+            printf("l2cap frame overflow %04x\n", dev.handle);
+            --rx->refs;
+            return;
+        }
+
+        block frame(rx->data.data(), rx->data.size());
+        dev.acldata(frame);
+        rx_retired.push_back(rx);
+        return;
+    }
+
+    if (rx != nullptr)
+    {
+        printf("l2cap frame truncated %04x\n", dev.handle);
+        dev.rx = nullptr;
+        --rx->refs;
+    }
+
+    auto expected = frame_length(pkt.data, pkt.size);
+    if (expected != 0 && pkt.size >= expected)
+    {
+        dev.acldata(pkt);
+        return;
+    }
+
+    rx = nullptr;
+    for (auto &buffer : rx_buffers)
+    {
+        if (buffer.refs == 0)
+        {
+            rx = &buffer;
+            break;
+        }
+    }
+
+    if (rx == nullptr)
+        rx = &rx_buffers.emplace_back();
+
+    rx->refs = 1;
+    rx->expected = expected;
+    rx->data.assign(pkt.data, pkt.data + pkt.size);
+    dev.rx = rx;
+}
+
+// the fields every inquiry result format has
+template <typename T>
+static discovery decode(const T *info)
+{
+    discovery found = {};
+    found.addr = info->bdaddr;
+    found.pscan_rep_mode = info->pscan_rep_mode;
+    found.pscan_period_mode = info->pscan_period_mode;
+    memcpy(found.dev_class, info->dev_class, sizeof(found.dev_class));
+    found.clock_offset = btohs(info->clock_offset);
+    return found;
+}
+
+template <typename T>
+static discovery decode_rssi(const T *info)
+{
+    auto found = decode(info);
+    found.has_rssi = true;
+    found.rssi = info->rssi;
+    return found;
+}
+
+// the complete local name in an extended inquiry response, or the
+// shortened one if that's all there is
+static std::string eir_name(const u8 *data, usize size)
+{
+    std::string name;
+    for (usize i = 0; i < size && data[i] != 0; i += 1 + data[i])
+    {
+        usize length = data[i];
+        if (i + 1 + length > size)
+            break;
+
+        auto type = data[i + 1];
+        if (type == 0x09 || (type == 0x08 && name.empty()))
+            name.assign((const char *)data + i + 2, length - 1);
+        if (type == 0x09)
+            break;
+    }
+
+    return name;
+}
+
+void adapter::inquiry(u8 evt, block &pkt)
+{
+    auto count = pkt.read_u8();
+    if (count == 0)
+        return;
+
+    // results with RSSI come with or without the page scan mode, only
+    // their size tells them apart
+    auto size = pkt.size / count;
+
+    for (u8 i = 0; i < count; ++i)
+    {
+        discovery found;
+        if (evt == EVT_INQUIRY_RESULT)
+        {
+            auto info = pkt.advance<inquiry_info>();
+            if (!info)
+                return;
+            found = decode(info);
+        }
+        else if (evt == EVT_INQUIRY_RESULT_WITH_RSSI && size == sizeof(inquiry_info_with_rssi_and_pscan_mode))
+        {
+            auto info = pkt.advance<inquiry_info_with_rssi_and_pscan_mode>();
+            if (!info)
+                return;
+            found = decode_rssi(info);
+        }
+        else if (evt == EVT_INQUIRY_RESULT_WITH_RSSI)
+        {
+            auto info = pkt.advance<inquiry_info_with_rssi>();
+            if (!info)
+                return;
+            found = decode_rssi(info);
+        }
+        else
+        {
+            auto info = pkt.advance<extended_inquiry_info>();
+            if (!info)
+                return;
+            found = decode_rssi(info);
+            found.name = eir_name(info->data, sizeof(info->data));
+        }
+
+        discover(found);
+    }
+
+    discoveries_changed.notify();
+}
+
+void adapter::discover(discovery &found)
+{
+    auto &entry = discoveries[found.addr];
+    if (found.name.empty())
+        found.name = std::move(entry.name);
+
+    found.seen = fiber::now();
+    entry = std::move(found);
+
+    inquiry_result.emit(entry);
+}
+
+const discovery *adapter::discovered(const bdaddr_t &addr) const
+{
+    auto entry = discoveries.find(addr);
+    return entry != discoveries.end() ? &entry->second : nullptr;
+}
+
+bool adapter::wait_discovery(const std::function<bool(const discovery &)> &match, discovery *out,
+                             fiber::time_point deadline)
+{
+    while (true)
+    {
+        for (auto &entry : discoveries)
+        {
+            if (!match(entry.second))
+                continue;
+
+            if (out != nullptr)
+                *out = entry.second;
+            return true;
+        }
+
+        if (!discoveries_changed.wait_until(deadline))
+            return false;
+    }
+}
+
+bool adapter::wait_discovery(const bdaddr_t &addr, discovery *out, fiber::time_point deadline)
+{
+    return wait_discovery([&addr](const discovery &found) { return found.addr == addr; }, out, deadline);
+}
+
+bool adapter::start_inquiry(u32 lap, u8 length, u8 num_rsp)
 {
     command cmd(*this, 0x01, 0x0001);
     cmd.write_u8(lap & 0xFF);
@@ -311,118 +954,118 @@ void adapter::start_inquiry(u32 lap, u8 length, u8 num_rsp)
     cmd.write_u8(length);
     cmd.write_u8(num_rsp);
 
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::stop_inquiry()
+bool adapter::stop_inquiry()
 {
     command cmd(*this, 0x01, 0x0002);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_default_link_policy(u16 policy)
+bool adapter::set_default_link_policy(u16 policy)
 {
     command cmd(*this, 0x02, 0x000F);
     cmd.write_u16(htobs(policy));
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_event_mask(u8 *mask)
+bool adapter::set_event_mask(u8 *mask)
 {
     command cmd(*this, 0x03, 0x0001);
     cmd.write(mask, 8);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::reset()
+bool adapter::reset()
 {
     command cmd(*this, 0x03, 0x0003);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::clear_event_filter()
+bool adapter::clear_event_filter()
 {
     command cmd(*this, 0x03, 0x0005);
     cmd.write_u8(0x00);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_pin_type(u8 pin_type)
+bool adapter::set_pin_type(u8 pin_type)
 {
     command cmd(*this, 0x03, 0x000A);
     cmd.write_u8(pin_type);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_local_name(const char *name)
+bool adapter::set_local_name(const char *name)
 {
     command cmd(*this, 0x03, 0x0013);
     strncpy((char *)cmd.data, name, 248);
     cmd.data += 248;
     cmd.size += 248;
     cmd.unused -= 248;
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_scan_mode(u8 scan_mode)
+bool adapter::set_scan_mode(u8 scan_mode)
 {
     command cmd(*this, 0x03, 0x001A);
     cmd.write_u8(scan_mode);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_page_scan_timing(u16 interval, u16 duration)
+bool adapter::set_page_scan_timing(u16 interval, u16 duration)
 {
     command cmd(*this, 0x03, 0x001C);
     cmd.write_u16(htobs(interval));
     cmd.write_u16(htobs(duration));
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_inquiry_scan_timing(u16 interval, u16 duration)
+bool adapter::set_inquiry_scan_timing(u16 interval, u16 duration)
 {
     command cmd(*this, 0x03, 0x001E);
     cmd.write_u16(htobs(interval));
     cmd.write_u16(htobs(duration));
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_auth_mode(u8 auth_mode)
+bool adapter::set_auth_mode(u8 auth_mode)
 {
     command cmd(*this, 0x03, 0x0020);
     cmd.write_u8(auth_mode);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_device_class(u8 minor, u16 major)
+bool adapter::set_device_class(u8 minor, u16 major)
 {
     command cmd(*this, 0x03, 0x0024);
     cmd.write_u8(minor << 2);
     cmd.write_u8(major & 0xFF);
     cmd.write_u8(major >> 8);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_inquiry_mode(u8 inquiry_mode)
+bool adapter::set_inquiry_mode(u8 inquiry_mode)
 {
     command cmd(*this, 0x03, 0x0045);
     cmd.write_u8(inquiry_mode);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_extended_inquiry_response(u8 fec_required, u8 *data)
+bool adapter::set_extended_inquiry_response(u8 fec_required, u8 *data)
 {
     command cmd(*this, 0x03, 0x0052);
     cmd.write_u8(fec_required);
     cmd.write(data, 240);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void adapter::set_simple_pairing_mode(u8 mode)
+bool adapter::set_simple_pairing_mode(u8 mode)
 {
     command cmd(*this, 0x03, 0x0056);
     cmd.write_u8(mode);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
 read_local_version_rp *adapter::read_local_version()
@@ -431,12 +1074,32 @@ read_local_version_rp *adapter::read_local_version()
     return cmd.run<read_local_version_rp>();
 }
 
+read_buffer_size_rp *adapter::read_buffer_size()
+{
+    command cmd(*this, 0x04, 0x0005);
+    auto rp = cmd.run<read_buffer_size_rp>();
+    if (rp == nullptr || !valid_status(&rp->status))
+        return nullptr;
+
+    acl_mtu = btohs(rp->acl_mtu);
+    acl_max_pkt = btohs(rp->acl_max_pkt);
+
+    usize in_flight = 0;
+    for (auto &dev : devices)
+        in_flight += dev.second.in_flight;
+    acl_free = acl_max_pkt > in_flight ? acl_max_pkt - in_flight : 0;
+
+    flush();
+    acl_freed.notify();
+    return rp;
+}
+
 bdaddr_t *adapter::read_local_address()
 {
     command cmd(*this, 0x04, 0x0009);
     block result;
-    cmd.run(&result);
-    valid_status(result.data);
+    if (!cmd.run(&result) || !valid_status(result.data))
+        return nullptr;
     return (bdaddr_t *)(result.data + 1);
 }
 
@@ -4,68 +4,246 @@
 #include "fiber.h"
 #include "common.h"
 
+#include <sys/uio.h>
+#include <deque>
+#include <memory>
+
 namespace bt
 {
 
-void valid_status(const u8 *status);
+// false if the command timed out, throws if the controller refused it
+bool valid_status(const u8 *status);
 
 class command;
 class device;
+class snoop;
+
+// an L2CAP frame reassembled from ACL fragments, pooled by the adapter and
+// recycled like a receive slot once refs drops to zero
+struct rx_buffer
+{
+    std::vector<u8> data;
+    usize expected = 0;
+    u16 refs = 0;
+};
+
+// what an inquiry last heard from a device
+struct discovery
+{
+    bdaddr_t addr;
+    u8 pscan_rep_mode;
+    u8 pscan_period_mode;
+    u8 dev_class[3];
+    // host order, as reported, without the valid bit connect wants
+    u16 clock_offset;
+    // only inquiry results with RSSI and extended ones have it
+    bool has_rssi;
+    i8 rssi;
+    // from the extended inquiry response, kept from an earlier result when
+    // a later one doesn't have it
+    std::string name;
+    fiber::time_point seen;
+};
 
 class adapter
 {
+    friend class command;
+    friend class device;
+    friend class channel;
+
 public:
-    u8 send_buffer[HCI_MAX_FRAME_SIZE];
+    // every response in an inquiry result event of any of the three
+    // formats, emitted once it's in the discovery table. responses in one
+    // event are emitted back to back, so only sync listeners see them all
+    emitter<discovery> inquiry_result;
 
-    emitter<block> inquiry_result;
+    // any connected fd that carries H4 packets, like a socketpair to a
+    // bt::fake_controller, a UNIX socket or a pty to a serial controller.
+    // the adapter takes ownership of it
+    struct transport
+    {
+        int fd;
+    };
 
     adapter(int num);
+    adapter(transport io);
+    // stops the adapter's fibers and waits for them to return, a dispatch
+    // blocked in a listener holds it up. inside a fiber it parks, outside
+    // one it runs the scheduler until they're done. a static adapter is
+    // destroyed at exit after the scheduler, it only closes fd then
     ~adapter();
 
-    void send(usize size);
+    // writes one packet gathered from parts. never blocks, while the
+    // transport is full packets are copied to a backlog the writer fiber
+    // sends once it's writable again
+    void send(const iovec *parts, usize count);
+
+    // records every packet sent and received from now on to a btsnoop
+    // file, see bt::snoop
+    void capture(const char *path);
+
+    // received packets stay valid until the fiber they were handed to next
+    // blocks, retain keeps one alive until it is released. blocks that
+    // don't point into the receive ring are ignored
+    void retain(const block &pkt);
+    void release(const block &pkt);
 
     void attach(command &cmd);
     void attach(device &dev);
     void detach(command &cmd);
     void detach(device &dev);
 
-    void start_inquiry(u32 lap, u8 length, u8 num_rsp);
-    void stop_inquiry();
+    // the hci commands return false, or null, if the controller doesn't
+    // answer within command::TIMEOUT
+    bool start_inquiry(u32 lap, u8 length, u8 num_rsp);
+    bool stop_inquiry();
 
-    void set_default_link_policy(u16 policy);
+    // null until an inquiry hears from addr
+    const discovery *discovered(const bdaddr_t &addr) const;
 
-    void set_event_mask(u8 *mask);
-    void reset();
-    void clear_event_filter();
+    // blocks until the discovery table has a device match accepts, devices
+    // heard before the call count too. false if the deadline passes first
+    bool wait_discovery(const std::function<bool(const discovery &)> &match, discovery *out,
+                        fiber::time_point deadline = fiber::time_point::max());
+    bool wait_discovery(const bdaddr_t &addr, discovery *out, fiber::time_point deadline = fiber::time_point::max());
 
-    void set_pin_type(u8 pin_type);
-    void set_local_name(const char *name);
-    void set_scan_mode(u8 scan_mode);
-    void set_page_scan_timing(u16 interval, u16 duration);
-    void set_inquiry_scan_timing(u16 interval, u16 duration);
-    void set_auth_mode(u8 auth_mode);
-    void set_device_class(u8 minor, u16 major);
-    void set_inquiry_mode(u8 inquiry_mode);
-    void set_extended_inquiry_response(u8 fec_required, u8 *data);
-    void set_simple_pairing_mode(u8 mode);
+    bool set_default_link_policy(u16 policy);
+
+    bool set_event_mask(u8 *mask);
+    bool reset();
+    bool clear_event_filter();
+
+    bool set_pin_type(u8 pin_type);
+    bool set_local_name(const char *name);
+    bool set_scan_mode(u8 scan_mode);
+    bool set_page_scan_timing(u16 interval, u16 duration);
+    bool set_inquiry_scan_timing(u16 interval, u16 duration);
+    bool set_auth_mode(u8 auth_mode);
+    bool set_device_class(u8 minor, u16 major);
+    bool set_inquiry_mode(u8 inquiry_mode);
+    bool set_extended_inquiry_response(u8 fec_required, u8 *data);
+    bool set_simple_pairing_mode(u8 mode);
 
     read_local_version_rp *read_local_version();
     bdaddr_t *read_local_address();
+    // ACL packets are fragmented to the size reported here, run it once
+    // the controller is reset
+    read_buffer_size_rp *read_buffer_size();
 
 private:
-    u8 recv_buffer[HCI_MAX_FRAME_SIZE];
-    emitter<usize> recv;
+    static const usize RECV_SLOTS = 8;
+    static const usize MAX_IDLE_DISPATCHERS = 2;
+
+    // refs sits after data so a block advanced to the end of a full frame
+    // still maps back to its own slot
+    struct recv_slot
+    {
+        u8 data[HCI_MAX_FRAME_SIZE];
+        u16 refs;
+        u16 size;
+    };
+
+    // slots are filled and dispatched in ring order, [dispatched, received)
+    // are waiting for a dispatcher
+    recv_slot recv_slots[RECV_SLOTS] = {};
+    usize received = 0;
+    usize dispatched = 0;
+    // bit per slot whose dispatch finished, dropped by feed once the fibers
+    // it woke have had a chance to run
+    u32 retired = 0;
+    condition recv_ready;
+    condition recv_freed;
+
+    std::deque<rx_buffer> rx_buffers;
+    // like retired, for reassembled frames that were dispatched
+    std::vector<rx_buffer *> rx_retired;
+
+    // zero until read_buffer_size ran, nothing is fragmented before that
+    u16 acl_mtu = 0;
+    u16 acl_max_pkt = 0;
+    // controller ACL buffers shared by all links, taken per fragment and
+    // given back by Number_Of_Completed_Packets
+    u16 acl_free = 0;
+    condition acl_freed;
+    // links with fragments queued, served one fragment each in turn
+    device *tx_ready = nullptr;
+    device **tx_ready_tail = &tx_ready;
+
+    // commands waiting for Command Complete or Command Status. the
+    // controller answers each opcode in order, so sent and answered number
+    // them and an answer goes to the command with the matching sequence
+    struct command_queue
+    {
+        u16 opcode;
+        bool used;
+        command *head;
+        u32 sent;
+        u32 answered;
+    };
+
+    // open addressed by opcode, entries are never removed since only a
+    // few dozen opcodes are ever used
+    static const usize COMMAND_SLOTS = 64;
+    command_queue commands[COMMAND_SLOTS] = {};
+    // Num_HCI_Command_Packets from the last Command Complete or Command
+    // Status, commands wait on credits_changed while it is zero
+    u8 command_credits = 1;
+    condition credits_changed;
+
+    // one entry per device any inquiry heard, never expired
+    std::unordered_map<bdaddr_t, discovery> discoveries;
+    condition discoveries_changed;
 
-    std::unordered_map<u16, command &> commands;
     std::unordered_map<bdaddr_t, device &> devices;
-    std::unordered_map<u16, device &> connections;
+    // indexed by the 12 bit connection handle
+    device *connections[0x1000] = {};
 
     int fd;
-    bool handled = false;
+    // stream transports don't keep packet boundaries, so packets are
+    // framed by their H4 header
+    bool stream = false;
+    usize idle = 0;
+
+    // packets the transport wouldn't take yet, in order. bounded by the
+    // controller's command credits and ACL buffers. a stream transport can
+    // take part of one, tx_offset is how much of the front went out
+    std::deque<std::vector<u8>> tx_backlog;
+    usize tx_offset = 0;
+    condition tx_backlogged;
+
+    std::unique_ptr<snoop> capture_log;
+
+    // set by the destructor, the fibers from start return once they see it
+    // and the last one notifies stopped
+    bool closing = false;
+    usize running = 0;
+    condition stopped;
 
+    // false if no credit came back before the deadline, nothing is sent
+    bool submit(command &cmd, fiber::time_point deadline);
+    void abandon(command &cmd);
+    command_queue *queue_of(u16 opcode, bool create);
+    command *answer(u16 opcode, u8 credits);
+    device *connection(u16 handle) { return connections[btohs(handle) & 0xFFF]; }
+
+    void schedule(device &dev);
+    void unschedule(device &dev);
+    void flush();
+
+    void start();
+    void spawn(const char *name, void (adapter::*body)(), usize stack_size = fiber::DEFAULT_STACK_SIZE);
+    // zero once the adapter is closing
+    int read_packet(u8 *out);
+    // false once the adapter is closing
+    bool read_exact(u8 *out, usize size);
     void feed();
+    void write_backlog();
     void run();
     void dispatch(block pkt);
+    void inquiry(u8 evt, block &pkt);
+    void discover(discovery &found);
+    void reassemble(device &dev, u16 boundary, block pkt);
+    u16 *refs_of(const block &pkt);
 
     template <typename T>
     void device_event(block &pkt)
@@ -88,13 +266,13 @@ private:
         auto evt = pkt.advance<T>();
         if (!evt)
             return;
-        auto dev = connections.find(evt->handle);
-        if (dev == connections.end())
+        auto dev = connection(evt->handle);
+        if (dev == nullptr)
         {
             printf("connection not found %04x\n", evt->handle);
             return;
         }
-        dev->second.event(evt);
+        dev->event(evt);
     }
 };
 
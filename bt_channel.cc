@@ -7,9 +7,18 @@ namespace bt
 {
 
 channel::channel(device &dev) : dev(dev) {}
-channel::~channel() {}
+channel::~channel()
+{
+    if (local_cid != 0)
+        dev.unregister_channel(local_cid);
+}
+
+bool channel::configure()
+{
+    return configure(fiber::after(device::L2CAP_TIMEOUT));
+}
 
-void channel::configure()
+bool channel::configure(fiber::time_point deadline)
 {
     u8 packet[L2CAP_CONF_REQ_SIZE + 4];
     auto conf_req = (l2cap_conf_req *)packet;
@@ -19,28 +28,68 @@ void channel::configure()
     packet[L2CAP_CONF_REQ_SIZE + 1] = 0x02;
     packet[L2CAP_CONF_REQ_SIZE + 2] = 0xC8;
     packet[L2CAP_CONF_REQ_SIZE + 3] = 0x05;
-    dev.l2cap_cmd<l2cap_conf_rsp>(L2CAP_CONF_REQ, packet);
+    if (dev.l2cap_cmd<l2cap_conf_rsp>(L2CAP_CONF_REQ, packet, deadline) == nullptr)
+        return false;
 
-    handshake.wait();
+    if (!handshake.wait_until(deadline))
+    {
+        printf("l2cap configuration timed out\n");
+        return false;
+    }
+
+    return true;
 }
 
 void channel::send(const block &src)
 {
-    dev.acquire_slot();
-
-    frame pkt(dev.hci.send_buffer, sizeof(dev.hci.send_buffer));
+    device::tx_packet out;
+    std::vector<u8> held;
+    transmit(out, src, held);
+    out.sent.wait();
+}
 
-    pkt.write_u8(HCI_ACLDATA_PKT);
-    auto acl = pkt.advance<hci_acl_hdr>();
-    acl->handle = handle | 0x2000;
-    acl->dlen = htobs(sizeof(l2cap_hdr) + src.size);
+void channel::transmit(device::tx_packet &out, const block &src, std::vector<u8> &held)
+{
+    frame pkt(out.l2cap, sizeof(out.l2cap));
 
     auto l2cap = pkt.advance<l2cap_hdr>();
     l2cap->cid = remote_cid;
     l2cap->len = htobs(src.size);
 
-    pkt.write(src.data, src.size);
-    dev.hci.send(pkt.size);
+    dev.transmit(out, pkt.size, ACL_START << 12, src.data, src.size);
+
+    // the rest waits for buffers, and the fragments still to go are read
+    // from the payload by offset
+    if (out.offset < out.l2cap_size + out.size)
+    {
+        held.assign(src.data, src.data + src.size);
+        out.payload = held.data();
+    }
+}
+
+bool channel::sender::await_ready()
+{
+    ch->transmit(out, src, held);
+    done = out.sent.operator co_await();
+    return done.await_ready();
+}
+
+// flush hands a link every free buffer when no other link is waiting, and
+// another link only waits while none are free. so with nothing queued
+// ahead, enough buffers for every fragment means send writes them all
+// before it returns
+bool channel::can_send(usize size)
+{
+    auto total = sizeof(l2cap_hdr) + size;
+    auto mtu = dev.hci.acl_mtu;
+    usize fragments = mtu != 0 ? (total + mtu - 1) / mtu : 1;
+
+    return dev.tx_head == nullptr && dev.hci.acl_free >= fragments;
+}
+
+condition &channel::writable()
+{
+    return dev.hci.acl_freed;
 }
 
 } // namespace bt
@@ -4,6 +4,8 @@
 #include "fiber.h"
 #include "common.h"
 
+#include "bt_device.h"
+
 namespace bt
 {
 
@@ -24,7 +26,6 @@ enum class channel_status : u8
 };
 
 class adapter;
-class device;
 
 class channel
 {
@@ -35,9 +36,39 @@ public:
     channel(device &dev);
     ~channel();
 
-    void configure();
+    // false if the peer didn't finish configuring before the deadline
+    bool configure();
+    bool configure(fiber::time_point deadline);
+
+    // the coroutine counterpart of send. the frame is queued when it's
+    // awaited and the async resumes once the controller has taken all of
+    // it
+    struct sender
+    {
+        channel *ch;
+        block src;
+        device::tx_packet out;
+        std::vector<u8> held;
+        task::awaiter done = {};
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<fiber::async::promise_type> handle) { done.await_suspend(handle); }
+        void await_resume() { done.await_resume(); }
+    };
 
+    // send blocks until the controller has taken every fragment of the
+    // frame, an async awaits send_async instead. src only has to stay
+    // valid until the call, or the co_await, starts: fragments are written
+    // straight from it while there are free buffers, and whatever has to
+    // wait is copied first since src may be a received packet whose slot
+    // the adapter reuses in the meantime
     void send(const block &src);
+    sender send_async(const block &src) { return {this, src}; }
+
+    // true when a frame of size bytes would be written before send returns,
+    // there is a free ACL buffer for every fragment and nothing queued ahead
+    bool can_send(usize size);
+    condition &writable();
 
     task handshake;
     emitter<block> data;
@@ -46,8 +77,11 @@ private:
     device &dev;
 
     u16 handle;
+    u16 local_cid = 0;
     u16 remote_cid;
     channel_status status = channel_status::CLOSED;
+
+    void transmit(device::tx_packet &out, const block &src, std::vector<u8> &held);
 };
 
 } // namespace bt
@@ -6,15 +6,13 @@ namespace bt
 {
 
 command::command(adapter &hci, u16 ogf, u16 ocf)
-    : frame(hci.send_buffer, sizeof(hci.send_buffer)),
+    : frame(buffer, sizeof(buffer)),
       opcode(cmd_opcode_pack(ogf, ocf)),
       hci(hci)
 {
     write_u8(HCI_COMMAND_PKT);
     write_u16(htobs(opcode));
     write_u8(0);
-
-    hci.attach(*this);
 }
 
 command::~command()
@@ -22,12 +20,25 @@ command::~command()
     hci.detach(*this);
 }
 
-void command::send()
+bool command::send(fiber::time_point deadline)
+{
+    buffer[3] = frame::size - 4;
+
+    if (hci.submit(*this, deadline))
+        return true;
+
+    printf("hci command %04x got no credit\n", opcode);
+    return false;
+}
+
+bool command::await(block *out, fiber::time_point deadline)
 {
-    auto size_ptr = (u8 *)(hci.send_buffer + 3);
-    *size_ptr = frame::size - 4;
+    if (result.next_until(out, deadline))
+        return true;
 
-    hci.send(size);
+    printf("hci command %04x timed out\n", opcode);
+    hci.abandon(*this);
+    return false;
 }
 
 // void command::run(block *out)
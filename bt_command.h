@@ -14,31 +14,45 @@ class command : public frame
     friend class adapter;
 
 public:
+    // how long run waits for Command Complete or Command Status by default
+    static const usize TIMEOUT = 2000;
+    // packet type, opcode, length and at most 255 bytes of parameters
+    static const usize MAX_SIZE = 4 + 255;
+
     const u16 opcode;
     emitter<block> result;
 
     command(adapter &hci, u16 ogf, u16 ocf);
     ~command();
 
-    void send();
+    // false if the controller had no room for it before the deadline
+    bool send(fiber::time_point deadline = fiber::after(TIMEOUT));
 
-    void run(block *out)
+    // false if the controller didn't answer before the deadline
+    bool run(block *out, fiber::time_point deadline = fiber::after(TIMEOUT))
     {
-        send();
-        result.next(out);
+        return send(deadline) && await(out, deadline);
     }
 
+    // null if the controller didn't answer before the deadline
     template <typename T>
-    T *run()
+    T *run(fiber::time_point deadline = fiber::after(TIMEOUT))
     {
-        send();
         block pkt;
-        result.next(&pkt);
+        if (!send(deadline) || !await(&pkt, deadline))
+            return nullptr;
         return (T *)pkt.data;
     }
 
 private:
     adapter &hci;
+
+    u8 buffer[MAX_SIZE];
+    // next command waiting on the same opcode, and which answer is ours
+    command *next = nullptr;
+    u32 sequence = 0;
+
+    bool await(block *out, fiber::time_point deadline);
 };
 
 } // namespace bt
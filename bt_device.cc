@@ -18,10 +18,13 @@ device::device(adapter &hci, const bdaddr_t &addr)
 
 device::~device()
 {
+    if (rx != nullptr)
+        --rx->refs;
+
     hci.detach(*this);
 }
 
-void device::connect(u16 packet_type, u8 page_scan_rep_mode, u16 clock_offset, u8 role)
+bool device::connect(u16 packet_type, u8 page_scan_rep_mode, u16 clock_offset, u8 role)
 {
     command cmd(hci, 0x01, 0x0005);
     cmd.write(addr);
@@ -30,7 +33,7 @@ void device::connect(u16 packet_type, u8 page_scan_rep_mode, u16 clock_offset, u
     cmd.write_u8(0x00);
     cmd.write_u16(htobs(clock_offset));
     cmd.write_u8(role);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
 void device::accept(u8 role)
@@ -38,22 +41,22 @@ void device::accept(u8 role)
     accepting = role;
 }
 
-void device::authenticate()
+bool device::authenticate()
 {
     command cmd(hci, 0x01, 0x0011);
     cmd.write_u16(htobs(handle));
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void device::encrypt(u8 mode)
+bool device::encrypt(u8 mode)
 {
     command cmd(hci, 0x01, 0x0013);
     cmd.write_u16(htobs(handle));
     cmd.write_u8(mode);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void device::qos_setup(u8 flags, u8 service_type, u32 token_rate, u32 peak_bw, u32 latency, u32 delay_variation)
+bool device::qos_setup(u8 flags, u8 service_type, u32 token_rate, u32 peak_bw, u32 latency, u32 delay_variation)
 {
     command cmd(hci, 0x02, 0x0007);
     cmd.write_u16(htobs(handle));
@@ -63,22 +66,59 @@ void device::qos_setup(u8 flags, u8 service_type, u32 token_rate, u32 peak_bw, u
     cmd.write_u32(htobl(peak_bw));
     cmd.write_u32(htobl(latency));
     cmd.write_u32(htobl(delay_variation));
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
 }
 
-void device::disconnect(u8 reason)
+bool device::disconnect(u8 reason)
 {
     command cmd(hci, 0x01, 0x0006);
     cmd.write_u16(htobs(handle));
     cmd.write_u8(reason);
-    valid_status(cmd.run<u8>());
+    return valid_status(cmd.run<u8>());
+}
+
+// cids are kept in wire order like everywhere else
+u16 device::allocate_cid()
+{
+    for (usize attempt = 0; attempt < MAX_CHANNELS; ++attempt)
+    {
+        auto cid = next_cid++;
+        if (next_cid == 0)
+            next_cid = 0x0040;
+
+        if (channels[cid % MAX_CHANNELS] == nullptr)
+            return htobs(cid);
+    }
+
+    errno = ENOSPC;
+    error("no free l2cap channel");
+    return 0;
 }
 
-void device::connect(channel &ch, u16 psm)
+void device::register_channel(channel &ch, u16 cid)
 {
-    auto local_cid = htobs(next_cid++);
+    ch.local_cid = cid;
+    channels[btohs(cid) % MAX_CHANNELS] = &ch;
+}
+
+void device::unregister_channel(u16 cid)
+{
+    auto &slot = channels[btohs(cid) % MAX_CHANNELS];
+    if (slot != nullptr && slot->local_cid == cid)
+        slot = nullptr;
+}
+
+channel *device::find_channel(u16 cid)
+{
+    auto ch = channels[btohs(cid) % MAX_CHANNELS];
+    return ch != nullptr && ch->local_cid == cid ? ch : nullptr;
+}
+
+bool device::connect(channel &ch, u16 psm, fiber::time_point deadline)
+{
+    auto local_cid = allocate_cid();
     ch.handle = handle;
-    channels.emplace(local_cid, ch);
+    register_channel(ch, local_cid);
 
     l2cap_conn_req req;
     req.scid = local_cid;
@@ -88,63 +128,120 @@ void device::connect(channel &ch, u16 psm)
     l2cap_conn_rsp *rsp;
     do
     {
-        rsp = l2cap_await<l2cap_conn_rsp>(ident);
-    } while (btohs(rsp->result) == 0x0001);
+        rsp = l2cap_await<l2cap_conn_rsp>(ident, deadline);
+    } while (rsp != nullptr && btohs(rsp->result) == 0x0001);
 
-    if (rsp->result != 0x0000)
+    if (rsp == nullptr || rsp->result != 0x0000)
     {
-        printf("l2cap result %04x\n", rsp->result);
-        throw std::runtime_error("l2cap connection failed");
+        if (rsp == nullptr)
+            printf("l2cap connection timed out\n");
+        else
+            printf("l2cap result %04x\n", rsp->result);
+
+        unregister_channel(local_cid);
+        ch.local_cid = 0;
+        return false;
     }
 
     ch.status = channel_status::CONFIG;
     ch.remote_cid = rsp->dcid;
+    return true;
 }
 
-void device::accept(channel &ch, u16 psm)
+bool device::accept(channel &ch, u16 psm, fiber::time_point deadline)
 {
     ch.handle = handle;
 
     promise<std::pair<u16, u16>> accept;
     accepting_psms.emplace(psm, &accept);
 
-    auto cids = accept.wait();
+    std::pair<u16, u16> cids;
+    if (!accept.wait_until(deadline, &cids))
+    {
+        accepting_psms.erase(psm);
+        printf("l2cap accept timed out\n");
+        return false;
+    }
 
-    channels.emplace(cids.first, ch);
+    register_channel(ch, cids.first);
     ch.remote_cid = cids.second;
     ch.status = channel_status::CONFIG;
 
     printf("accepted %04x (%04x)\n", cids.first, cids.second);
+    return true;
 }
 
-void device::acquire_slot()
+void device::transmit(tx_packet &pkt, usize l2cap_size, u16 start_flags, const void *src, usize size)
 {
-    // printf("send %zu %zu\n", full_slots, max_slots);
+    pkt.l2cap_size = l2cap_size;
+    pkt.start_flags = start_flags;
+    pkt.payload = (const u8 *)src;
+    pkt.size = size;
 
-    // auto start = std::chrono::high_resolution_clock::now();
+    *tx_tail = &pkt;
+    tx_tail = &pkt.next;
 
-    while (full_slots >= total_slots)
+    hci.schedule(*this);
+    hci.flush();
+}
+
+// true once the last fragment is written
+bool device::send_fragment(tx_packet &pkt)
+{
+    auto total = pkt.l2cap_size + pkt.size;
+    auto start = pkt.offset;
+    auto end = total;
+    if (hci.acl_mtu != 0 && end - start > hci.acl_mtu)
+        end = start + hci.acl_mtu;
+
+    frame out(pkt.acl, sizeof(pkt.acl));
+    out.write_u8(HCI_ACLDATA_PKT);
+    auto acl = out.advance<hci_acl_hdr>();
+    acl->handle = handle | htobs(start == 0 ? pkt.start_flags : ACL_CONT << 12);
+    acl->dlen = htobs(end - start);
+
+    iovec parts[3];
+    usize count = 0;
+    parts[count++] = {pkt.acl, sizeof(pkt.acl)};
+
+    if (start < pkt.l2cap_size)
+        parts[count++] = {pkt.l2cap + start, std::min(end, pkt.l2cap_size) - start};
+
+    if (end > pkt.l2cap_size)
     {
-        // printf("waiting\n");
-        slots_changed.wait();
+        auto from = std::max(start, pkt.l2cap_size) - pkt.l2cap_size;
+        parts[count++] = {(void *)(pkt.payload + from), end - pkt.l2cap_size - from};
     }
 
-    // auto end = std::chrono::high_resolution_clock::now();
-    // printf("sending %ld\n", std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    hci.send(parts, count);
+    pkt.offset = end;
 
-    ++full_slots;
-    slots_changed.notify();
+    return end == total;
 }
 
-void device::l2cap_send(u8 ident, u8 code, const void *src, usize size)
+// writes one fragment into a controller buffer the adapter handed us,
+// true while more are queued
+bool device::send_next()
 {
-    acquire_slot();
+    auto pkt = tx_head;
+
+    ++in_flight;
+    if (send_fragment(*pkt))
+    {
+        tx_head = pkt->next;
+        if (tx_head == nullptr)
+            tx_tail = &tx_head;
 
-    frame pkt(hci.send_buffer, sizeof(hci.send_buffer));
-    pkt.write_u8(HCI_ACLDATA_PKT);
-    auto acl = pkt.advance<hci_acl_hdr>();
-    acl->handle = handle;
-    acl->dlen = htobs(sizeof(l2cap_hdr) + sizeof(l2cap_cmd_hdr) + size);
+        pkt->sent.resolve();
+    }
+
+    return tx_head != nullptr;
+}
+
+void device::l2cap_send(u8 ident, u8 code, const void *src, usize size)
+{
+    tx_packet out;
+    frame pkt(out.l2cap, sizeof(out.l2cap));
 
     auto l2cap = pkt.advance<l2cap_hdr>();
     l2cap->cid = htobs(0x01);
@@ -155,8 +252,8 @@ void device::l2cap_send(u8 ident, u8 code, const void *src, usize size)
     cmd->ident = ident;
     cmd->len = htobs(size);
 
-    pkt.write(src, size);
-    hci.send(pkt.size);
+    transmit(out, pkt.size, ACL_START_NO_FLUSH << 12, src, size);
+    out.sent.wait();
 }
 
 void device::acldata(block &pkt)
@@ -185,11 +282,11 @@ void device::acldata(block &pkt)
 
         if (cmd->code & 0x01)
         {
-            auto req = l2cap_commands.find(cmd->ident);
-            if (req == l2cap_commands.end())
+            auto req = l2cap_commands[cmd->ident];
+            if (req == nullptr)
                 return;
 
-            req->second->resolve(pkt);
+            req->resolve(pkt);
         }
         else
         {
@@ -202,11 +299,11 @@ void device::acldata(block &pkt)
     }
     else
     {
-        auto channel = channels.find(hdr->cid);
-        if (channel == channels.end())
+        auto channel = find_channel(hdr->cid);
+        if (channel == nullptr)
             return;
 
-        channel->second.data.emit(pkt);
+        channel->data.emit(pkt);
     }
 }
 
@@ -227,7 +324,7 @@ void device::l2cap(u8 ident, l2cap_conn_req *req)
     }
     else
     {
-        auto local_cid = htobs(next_cid++);
+        auto local_cid = allocate_cid();
 
         rsp.dcid = local_cid;
         rsp.status = htobs(0x0000);
@@ -244,9 +341,9 @@ void device::l2cap(u8 ident, l2cap_conf_req *req)
 {
     printf("conf req %04x\n", req->dcid);
 
-    auto ch = channels.find(req->dcid);
-    if (ch == channels.end() || (ch->second.status != channel_status::OPEN &&
-                                 ch->second.status != channel_status::CONFIG))
+    auto ch = find_channel(req->dcid);
+    if (ch == nullptr || (ch->status != channel_status::OPEN &&
+                          ch->status != channel_status::CONFIG))
     {
         u8 buffer[6];
         frame reject(buffer, sizeof(buffer));
@@ -258,19 +355,19 @@ void device::l2cap(u8 ident, l2cap_conf_req *req)
     else
     {
         l2cap_conf_rsp rsp;
-        rsp.scid = ch->second.remote_cid;
+        rsp.scid = ch->remote_cid;
         rsp.flags = htobs(0x0000);
         rsp.result = htobs(0x0000);
         l2cap_reply(ident, L2CAP_CONF_RSP, rsp);
 
-        ch->second.handshake.resolve();
+        ch->handshake.resolve();
     }
 }
 
 void device::l2cap(u8 ident, l2cap_disconn_req *req)
 {
-    auto ch = channels.find(req->dcid);
-    if (ch == channels.end())
+    auto ch = find_channel(req->dcid);
+    if (ch == nullptr)
     {
         u8 buffer[6];
         frame reject(buffer, sizeof(buffer));
@@ -286,8 +383,8 @@ void device::l2cap(u8 ident, l2cap_disconn_req *req)
         rsp.write_u16(req->dcid);
         rsp.write_u16(req->scid);
         l2cap_reply(ident, L2CAP_DISCONN_RSP, buffer);
-        ch->second.data.emit(block());
-        ch->second.status = channel_status::CLOSED;
+        ch->data.emit(block());
+        ch->status = channel_status::CLOSED;
     }
 }
 
@@ -345,6 +442,34 @@ void device::event(evt_conn_request *evt)
 
 void device::event(evt_disconn_complete *evt)
 {
+    // the controller frees a closed link's buffers without reporting them
+    // completed, and whatever is still queued can't be sent anymore
+    hci.unschedule(*this);
+    hci.acl_free += in_flight;
+    in_flight = 0;
+
+    while (tx_head != nullptr)
+    {
+        auto pkt = tx_head;
+        tx_head = pkt->next;
+        pkt->sent.resolve();
+    }
+    tx_tail = &tx_head;
+
+    hci.flush();
+    hci.acl_freed.notify();
+
+    // the handle can be reused by the next link
+    if (hci.connection(handle) == this)
+        hci.connections[btohs(handle) & 0xFFF] = nullptr;
+
+    // a frame cut off by the disconnect never completes
+    if (rx != nullptr)
+    {
+        --rx->refs;
+        rx = nullptr;
+    }
+
     handle = 0;
 }
 
@@ -453,8 +578,6 @@ void device::event(evt_link_key_notify *evt)
 
 void device::event(evt_max_slots_change *evt)
 {
-    total_slots = evt->max_slots;
-    slots_changed.notify();
 }
 
 void device::event(evt_read_clock_offset_complete *evt)
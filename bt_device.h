@@ -5,12 +5,14 @@
 #include "common.h"
 
 #include <bluetooth/l2cap.h>
+#include <sys/uio.h>
 
 namespace bt
 {
 
 class channel;
 class adapter;
+struct rx_buffer;
 
 class device
 {
@@ -27,36 +29,83 @@ public:
     device(adapter &hci, const bdaddr_t &addr);
     ~device();
 
-    void connect(u16 packet_Type, u8 page_scan_rep_mode, u16 clock_offset, u8 role);
+    // the hci commands return false if the controller doesn't answer in
+    // time, the link events still come later on the conditions above
+    bool connect(u16 packet_Type, u8 page_scan_rep_mode, u16 clock_offset, u8 role);
     void accept(u8 role);
 
-    void authenticate();
-    void encrypt(u8 mode);
+    bool authenticate();
+    bool encrypt(u8 mode);
 
-    void qos_setup(u8 flags, u8 service_type, u32 token_rate, u32 peak_bw, u32 latency, u32 delay_variation);
+    bool qos_setup(u8 flags, u8 service_type, u32 token_rate, u32 peak_bw, u32 latency, u32 delay_variation);
 
-    void disconnect(u8 reason);
+    bool disconnect(u8 reason);
 
-    void connect(channel &ch, u16 psm);
-    void accept(channel &ch, u16 psm);
+    // how long an l2cap request waits for its response by default
+    static const usize L2CAP_TIMEOUT = 5000;
+
+    // false if the peer refused or didn't answer before the deadline
+    bool connect(channel &ch, u16 psm, fiber::time_point deadline = fiber::after(L2CAP_TIMEOUT));
+    bool accept(channel &ch, u16 psm, fiber::time_point deadline = fiber::time_point::max());
 
 private:
-    std::unordered_map<u8, promise<block> *> l2cap_commands;
+    // channels are found by local cid modulo MAX_CHANNELS, new cids skip
+    // ahead to a free slot so lookups never probe
+    static const usize MAX_CHANNELS = 64;
+
+    // indexed by ident
+    promise<block> *l2cap_commands[256] = {};
     std::unordered_map<u16, promise<std::pair<u16, u16>> *> accepting_psms;
-    std::unordered_map<u16, channel &> channels;
+    channel *channels[MAX_CHANNELS] = {};
     adapter &hci;
 
-    condition slots_changed;
-    u16 full_slots = 0;
-    u16 total_slots = 0;
-
     u16 handle = 0;
     u16 next_cid = 0x0040;
     u8 next_ident = 0x01;
 
     int accepting = -1;
 
-    void acquire_slot();
+    // an l2cap frame waiting for controller buffers, sent as fragments of
+    // at most acl_mtu bytes. the headers are built here and the payload is
+    // written straight from the sender's memory, which stays put since the
+    // sender waits on sent, on its stack or in its coroutine frame
+    struct tx_packet
+    {
+        u8 acl[1 + sizeof(hci_acl_hdr)];
+        u8 l2cap[sizeof(l2cap_hdr) + sizeof(l2cap_cmd_hdr)];
+        usize l2cap_size;
+        u16 start_flags;
+        const u8 *payload;
+        usize size;
+        // bytes of l2cap header and payload already written
+        usize offset = 0;
+        tx_packet *next = nullptr;
+        task sent;
+    };
+
+    // frames go out in the order they were queued on this connection
+    tx_packet *tx_head = nullptr;
+    tx_packet **tx_tail = &tx_head;
+
+    // fragments written and not yet reported completed
+    u16 in_flight = 0;
+    // next link in the adapter's round robin
+    device *tx_next = nullptr;
+    bool tx_scheduled = false;
+
+    // the frame being reassembled from fragments, if any
+    rx_buffer *rx = nullptr;
+
+    u16 allocate_cid();
+    void register_channel(channel &ch, u16 cid);
+    void unregister_channel(u16 cid);
+    channel *find_channel(u16 cid);
+
+    // queues pkt and writes what the free buffers allow, sent resolves once
+    // the rest is written
+    void transmit(tx_packet &pkt, usize l2cap_size, u16 start_flags, const void *src, usize size);
+    bool send_fragment(tx_packet &pkt);
+    bool send_next();
     void l2cap_send(u8 ident, u8 code, const void *src, usize size);
 
     template <typename TArg>
@@ -67,22 +116,29 @@ private:
         return ident;
     }
 
+    // null if the deadline passes first
     template <typename TOut>
-    TOut *l2cap_await(u8 ident)
+    TOut *l2cap_await(u8 ident, fiber::time_point deadline)
     {
         promise<block> result;
-        l2cap_commands.emplace(ident, &result);
-        auto ret = result.wait();
-        l2cap_commands.erase(ident);
+        l2cap_commands[ident] = &result;
+
+        block ret;
+        auto answered = result.wait_until(deadline, &ret);
+        l2cap_commands[ident] = nullptr;
 
-        return (TOut *)ret.data;
+        return answered ? (TOut *)ret.data : nullptr;
     }
 
     template <typename TOut, typename TArg>
-    TOut *l2cap_cmd(u8 code, const TArg &arg)
+    TOut *l2cap_cmd(u8 code, const TArg &arg, fiber::time_point deadline = fiber::after(L2CAP_TIMEOUT))
     {
         auto ident = l2cap_cmd(code, arg);
-        return l2cap_await<TOut>(ident);
+        auto rsp = l2cap_await<TOut>(ident, deadline);
+        if (rsp == nullptr)
+            printf("l2cap request %02x timed out\n", code);
+
+        return rsp;
     }
 
     template <typename TArg>
@@ -0,0 +1,417 @@
+#include "bt_fake_console.h"
+
+#include "bt_fake_controller.h"
+
+#include <bluetooth/l2cap.h>
+#include <cmath>
+#include <string.h>
+
+namespace bt
+{
+
+using std::chrono::duration;
+
+// how long the console waits on each step before giving up on the host
+static const usize STEP_TIMEOUT = 5000;
+static const usize SUBCOMMAND_RETRY = 100;
+// the largest l2cap payload the console sends, signalling included
+static const usize MAX_FRAME = 255;
+
+static double elapsed_ms(fiber::time_point from, fiber::time_point to)
+{
+    return duration<double, std::milli>(to - from).count();
+}
+
+fake_console::fake_console(fake_controller &ctl, const bdaddr_t &addr) : ctl(ctl), addr(addr)
+{
+    ctl.acl = [this](u16 handle, u8 boundary, block data) { received(handle, boundary, data); };
+}
+
+fake_console::~fake_console()
+{
+    ctl.acl = nullptr;
+}
+
+bool fake_console::page()
+{
+    start = fiber::now();
+
+    ctl.connection_request(addr);
+    if (!wait(ctl.links_changed, [this] { return (handle = ctl.link(addr)) != 0; }, "connection"))
+        return false;
+
+    for (auto ch : {&control, &interrupt})
+    {
+        // refused while the host isn't accepting the psm yet, so ask again
+        // like a console does
+        while (ch->remote_cid == 0)
+        {
+            ch->refused = false;
+
+            l2cap_conn_req req;
+            req.psm = htobs(ch->psm);
+            req.scid = ch->local_cid;
+            command(L2CAP_CONN_REQ, next_ident++, (u8 *)&req, sizeof(req));
+
+            if (!wait(changed, [ch] { return ch->remote_cid != 0 || ch->refused; }, "l2cap connection"))
+                return false;
+            if (ch->refused)
+                fiber::delay(10);
+        }
+    }
+
+    return true;
+}
+
+bool fake_console::measure(usize reports, results *out)
+{
+    if (handle == 0)
+    {
+        if (!wait(ctl.links_changed, [this] { return (handle = ctl.link(addr)) != 0; }, "connection"))
+            return false;
+        start = fiber::now();
+    }
+
+    if (!wait(changed, [this] { return control.configured && interrupt.configured; }, "hid channels"))
+        return false;
+    // the controller talks first
+    if (!wait(changed, [this] { return inputs != 0; }, "first input report"))
+        return false;
+
+    // what a switch asks a pro controller it just connected to
+    auto spi_read = [this](u32 address, u8 length) {
+        u8 args[5];
+        frame out(args, sizeof(args));
+        out.write_u32(htobl(address));
+        out.write_u8(length);
+        return subcommand(0x10, args, sizeof(args));
+    };
+
+    u8 off = 0x00, on = 0x01, full = 0x30;
+    auto answered = subcommand(0x02) &&           // device info
+                    subcommand(0x08, &off, 1) &&  // low power
+                    spi_read(0x6000, 0x10) &&     // serial number
+                    spi_read(0x6050, 0x0d) &&     // colours
+                    subcommand(0x03, &full, 1) && // report mode
+                    subcommand(0x04) &&           // trigger elapsed time
+                    spi_read(0x6080, 0x18) &&     // factory sensor and stick parameters
+                    spi_read(0x603d, 0x19) &&     // factory stick calibration
+                    spi_read(0x8010, 0x18) &&     // user stick calibration
+                    subcommand(0x40, &on, 1) &&   // imu
+                    subcommand(0x48, &on, 1) &&   // vibration
+                    subcommand(0x30, &on, 1);     // player lights
+    if (!answered)
+        return false;
+
+    out->handshake_ms = elapsed_ms(start, fiber::now());
+
+    // one more arrival than intervals
+    arrivals.clear();
+    wanted = reports + 1;
+    auto received = wait(changed, [this] { return arrivals.size() >= wanted; }, "input reports",
+                         fiber::after(STEP_TIMEOUT + reports * 100));
+    wanted = 0;
+    if (!received)
+        return false;
+
+    out->first_report_ms = elapsed_ms(start, first_report);
+    out->reports = reports;
+
+    double sum = 0, squares = 0, max = 0;
+    for (usize i = 1; i < arrivals.size(); ++i)
+    {
+        auto us = duration<double, std::micro>(arrivals[i] - arrivals[i - 1]).count();
+        sum += us;
+        squares += us * us;
+        max = std::max(max, us);
+    }
+
+    out->interval_mean_us = sum / reports;
+    out->interval_jitter_us =
+        std::sqrt(std::max(0.0, squares / reports - out->interval_mean_us * out->interval_mean_us));
+    out->interval_max_us = max;
+    return true;
+}
+
+bool fake_console::wait(condition &cv, const std::function<bool()> &done, const char *what, fiber::time_point deadline)
+{
+    if (deadline == fiber::time_point())
+        deadline = fiber::after(STEP_TIMEOUT);
+
+    while (!done())
+    {
+        if (!cv.wait_until(deadline))
+        {
+            printf("fake console timed out waiting for %s\n", what);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void fake_console::received(u16 link, u8 boundary, block data)
+{
+    if (handle == 0)
+        handle = ctl.link(addr);
+    if (link != handle)
+        return;
+
+    if (boundary == ACL_CONT)
+    {
+        if (rx.empty())
+            return;
+        rx.insert(rx.end(), data.data, data.data + data.size);
+    }
+    else
+        rx.assign(data.data, data.data + data.size);
+
+    if (rx.size() < sizeof(l2cap_hdr))
+        return;
+
+    auto hdr = (l2cap_hdr *)rx.data();
+    auto total = sizeof(l2cap_hdr) + btohs(hdr->len);
+    if (rx.size() < total)
+        return;
+
+    block pkt(rx.data() + sizeof(l2cap_hdr), total - sizeof(l2cap_hdr));
+    if (btohs(hdr->cid) == 0x0001)
+        signalling(pkt);
+    else if (hdr->cid == interrupt.local_cid)
+        report(pkt);
+
+    rx.clear();
+}
+
+void fake_console::signalling(block pkt)
+{
+    while (auto cmd = pkt.advance<l2cap_cmd_hdr>())
+    {
+        auto size = std::min<usize>(btohs(cmd->len), pkt.size);
+        block args(pkt.data, size);
+        pkt.skip(size);
+
+        switch (cmd->code)
+        {
+        case L2CAP_CONN_REQ:
+        {
+            auto req = args.advance<l2cap_conn_req>();
+            if (!req)
+                break;
+
+            auto ch = btohs(req->psm) == control.psm ? &control : btohs(req->psm) == interrupt.psm ? &interrupt : nullptr;
+
+            l2cap_conn_rsp rsp;
+            rsp.dcid = ch ? ch->local_cid : 0;
+            rsp.scid = req->scid;
+            rsp.result = htobs(ch ? 0x0000 : 0x0002);
+            rsp.status = htobs(0x0000);
+            if (ch)
+                ch->remote_cid = req->scid;
+
+            command(L2CAP_CONN_RSP, cmd->ident, (u8 *)&rsp, sizeof(rsp));
+            break;
+        }
+
+        case L2CAP_CONN_RSP:
+        {
+            auto rsp = args.advance<l2cap_conn_rsp>();
+            auto ch = rsp ? find(rsp->scid) : nullptr;
+            if (!ch || btohs(rsp->result) == 0x0001)
+                break;
+
+            if (rsp->result == 0x0000)
+                ch->remote_cid = rsp->dcid;
+            else
+                ch->refused = true;
+            changed.notify();
+            break;
+        }
+
+        case L2CAP_CONF_REQ:
+        {
+            auto req = args.advance<l2cap_conf_req>();
+            if (!req)
+                break;
+
+            auto ch = find(req->dcid);
+            if (!ch)
+            {
+                u8 reject[6];
+                frame out(reject, sizeof(reject));
+                out.write_u16(htobs(0x0002));
+                out.write_u16(0x0000);
+                out.write_u16(req->dcid);
+                command(L2CAP_COMMAND_REJ, cmd->ident, reject, sizeof(reject));
+                break;
+            }
+
+            l2cap_conf_rsp rsp;
+            rsp.scid = ch->remote_cid;
+            rsp.flags = htobs(0x0000);
+            rsp.result = htobs(0x0000);
+            command(L2CAP_CONF_RSP, cmd->ident, (u8 *)&rsp, sizeof(rsp));
+
+            // then our side of the configuration, no options
+            l2cap_conf_req own;
+            own.dcid = ch->remote_cid;
+            own.flags = htobs(0x0000);
+            command(L2CAP_CONF_REQ, next_ident++, (u8 *)&own, sizeof(own));
+            break;
+        }
+
+        case L2CAP_CONF_RSP:
+        {
+            auto rsp = args.advance<l2cap_conf_rsp>();
+            auto ch = rsp ? find(rsp->scid) : nullptr;
+            if (!ch)
+                break;
+
+            ch->configured = rsp->result == 0x0000;
+            changed.notify();
+            break;
+        }
+
+        case L2CAP_DISCONN_REQ:
+        {
+            auto req = args.advance<l2cap_disconn_req>();
+            auto ch = req ? find(req->dcid) : nullptr;
+            if (!ch)
+                break;
+
+            command(L2CAP_DISCONN_RSP, cmd->ident, (u8 *)req, sizeof(*req));
+            ch->remote_cid = 0;
+            ch->configured = false;
+            changed.notify();
+            break;
+        }
+
+        case L2CAP_ECHO_REQ:
+            command(L2CAP_ECHO_RSP, cmd->ident, args.data, args.size);
+            break;
+
+        case L2CAP_INFO_REQ:
+        {
+            auto req = args.advance<l2cap_info_req>();
+            if (!req)
+                break;
+
+            u8 rsp[L2CAP_INFO_RSP_SIZE];
+            frame out(rsp, sizeof(rsp));
+            out.write_u16(req->type);
+            out.write_u16(htobs(0x0001)); // not supported
+            command(L2CAP_INFO_RSP, cmd->ident, rsp, sizeof(rsp));
+            break;
+        }
+        }
+    }
+}
+
+// input reports from the host, a1 then the report id
+void fake_console::report(block pkt)
+{
+    if (pkt.size < 2 || pkt.data[0] != 0xa1)
+        return;
+
+    if (inputs++ == 0)
+        changed.notify();
+
+    if (pkt.data[1] == 0x21)
+    {
+        // the subcommand being acknowledged follows the input state
+        if (pkt.size > 15)
+        {
+            reply = pkt.data[15];
+            changed.notify();
+        }
+    }
+    else if (pkt.data[1] == 0x30)
+    {
+        auto now = fiber::now();
+        if (first_report == fiber::time_point())
+            first_report = now;
+
+        if (arrivals.size() < wanted)
+        {
+            arrivals.push_back(now);
+            if (arrivals.size() == wanted)
+                changed.notify();
+        }
+    }
+}
+
+void fake_console::send(u16 cid, const u8 *data, usize size)
+{
+    u8 buffer[sizeof(l2cap_hdr) + MAX_FRAME];
+    frame pkt(buffer, sizeof(buffer));
+
+    auto hdr = pkt.advance<l2cap_hdr>();
+    hdr->cid = cid;
+    hdr->len = htobs(size);
+    pkt.write(data, size);
+
+    ctl.send_acl(handle, block(buffer, pkt.size));
+}
+
+void fake_console::command(u8 code, u8 ident, const u8 *data, usize size)
+{
+    u8 buffer[MAX_FRAME];
+    frame pkt(buffer, sizeof(buffer));
+
+    // an echo reply carries whatever the host sent, cut to what fits
+    size = std::min(size, sizeof(buffer) - sizeof(l2cap_cmd_hdr));
+
+    auto hdr = pkt.advance<l2cap_cmd_hdr>();
+    hdr->code = code;
+    hdr->ident = ident;
+    hdr->len = htobs(size);
+    pkt.write(data, size);
+
+    send(htobs(0x0001), buffer, pkt.size);
+}
+
+// an output report 0x01 on the interrupt channel, answered by a 0x21
+// input report naming the same subcommand
+bool fake_console::subcommand(u8 id, const u8 *args, usize size)
+{
+    static const u8 neutral_rumble[] = {0x00, 0x01, 0x40, 0x40, 0x00, 0x01, 0x40, 0x40};
+
+    u8 buffer[64];
+    frame pkt(buffer, sizeof(buffer));
+    pkt.write_u8(0xa2);
+    pkt.write_u8(0x01);
+    pkt.write_u8(output_timer++ & 0x0F);
+    pkt.write(neutral_rumble, sizeof(neutral_rumble));
+    pkt.write_u8(id);
+    if (size != 0)
+        pkt.write(args, size);
+
+    // resent until it's answered, like a console does when the controller
+    // wasn't listening yet
+    reply = -1;
+    auto deadline = fiber::after(STEP_TIMEOUT);
+    while (reply != id)
+    {
+        if (fiber::now() >= deadline)
+        {
+            printf("fake console timed out waiting for subcommand %02x reply\n", id);
+            return false;
+        }
+
+        send(interrupt.remote_cid, buffer, pkt.size);
+        changed.wait_until(std::min(deadline, fiber::after(SUBCOMMAND_RETRY)));
+    }
+
+    return true;
+}
+
+fake_console::hid_channel *fake_console::find(u16 cid)
+{
+    if (cid == control.local_cid)
+        return &control;
+    if (cid == interrupt.local_cid)
+        return &interrupt;
+    return nullptr;
+}
+
+} // namespace bt
@@ -0,0 +1,87 @@
+#ifndef BT_FAKE_CONSOLE_H
+#define BT_FAKE_CONSOLE_H
+
+#include "fiber.h"
+#include "common.h"
+
+namespace bt
+{
+
+class fake_controller;
+
+// a switch at the far end of a fake_controller's baseband. it answers the
+// l2cap signalling for the hid channels whichever side opens them, runs
+// the console's subcommand handshake over the interrupt channel and
+// timestamps the 0x30 input reports that follow
+class fake_console
+{
+public:
+    struct results
+    {
+        // from paging, or from the link coming up when the host connected
+        double handshake_ms;
+        double first_report_ms;
+        usize reports;
+        double interval_mean_us;
+        double interval_jitter_us; // standard deviation
+        double interval_max_us;
+    };
+
+    fake_console(fake_controller &ctl, const bdaddr_t &addr);
+    ~fake_console();
+
+    // connects to the host and opens the hid channels like a console
+    // reconnecting to a paired controller does. otherwise it waits for the
+    // host to connect. both return false if the host stops answering
+    bool page();
+
+    // runs the handshake once the channels are open, then collects reports
+    // intervals
+    bool measure(usize reports, results *out);
+
+private:
+    struct hid_channel
+    {
+        u16 psm;
+        // ours and the host's, in wire order
+        u16 local_cid;
+        u16 remote_cid = 0;
+        bool configured = false;
+        bool refused = false;
+    };
+
+    fake_controller &ctl;
+    bdaddr_t addr;
+    u16 handle = 0;
+    u8 next_ident = 0x01;
+
+    hid_channel control{0x11, htobs(0x0040)};
+    hid_channel interrupt{0x13, htobs(0x0041)};
+    condition changed;
+
+    fiber::time_point start;
+    fiber::time_point first_report;
+    std::vector<fiber::time_point> arrivals;
+    usize wanted = 0;
+    usize inputs = 0;
+    // the last subcommand acknowledged
+    int reply = -1;
+    u8 output_timer = 0;
+
+    std::vector<u8> rx;
+
+    bool wait(condition &cv, const std::function<bool()> &done, const char *what,
+              fiber::time_point deadline = fiber::time_point());
+    void received(u16 handle, u8 boundary, block data);
+    void signalling(block pkt);
+    void report(block pkt);
+
+    void send(u16 cid, const u8 *data, usize size);
+    void command(u8 code, u8 ident, const u8 *data, usize size);
+    bool subcommand(u8 id, const u8 *args = nullptr, usize size = 0);
+    hid_channel *find(u16 cid);
+};
+
+} // namespace bt
+
+#endif
@@ -0,0 +1,449 @@
+#include "bt_fake_controller.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace bt
+{
+
+static std::vector<u8> event_packet(u8 code, const u8 *params, usize size)
+{
+    std::vector<u8> pkt(3 + size);
+    pkt[0] = HCI_EVENT_PKT;
+    pkt[1] = code;
+    pkt[2] = size;
+    memcpy(pkt.data() + 3, params, size);
+    return pkt;
+}
+
+// a successful event about a link, status and handle then the rest
+static std::vector<u8> link_event(u8 code, u16 handle, std::initializer_list<u8> rest = {})
+{
+    u8 params[8];
+    frame evt(params, sizeof(params));
+    evt.write_u8(0x00);
+    evt.write_u16(htobs(handle));
+    for (auto value : rest)
+        evt.write_u8(value);
+    return event_packet(code, params, evt.size);
+}
+
+static std::vector<u8> connection_complete(u8 status, u16 handle, const bdaddr_t &peer)
+{
+    u8 params[sizeof(evt_conn_complete)];
+    frame evt(params, sizeof(params));
+    evt.write_u8(status);
+    evt.write_u16(htobs(handle));
+    evt.write(peer);
+    evt.write_u8(0x01); // ACL
+    evt.write_u8(0x00);
+    return event_packet(EVT_CONN_COMPLETE, params, evt.size);
+}
+
+fake_controller::fake_controller()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+        error("failed to create fake controller transport");
+
+    fd = fds[0];
+    host = fds[1];
+
+    // the host reads on this thread too, so a write that blocked would
+    // never be read
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    spawn("fake controller", [this] { run(); });
+    spawn("fake controller writer", [this] { write_backlog(); });
+}
+
+fake_controller::~fake_controller()
+{
+    // none of the fibers can run again
+    if (!fiber::alive())
+    {
+        close(fd);
+        return;
+    }
+
+    closing = true;
+    fiber::wake(fd);
+    backlogged.notify();
+
+    while (running != 0)
+    {
+        if (fiber::inside())
+            stopped.wait();
+        else
+            fiber::run();
+    }
+
+    fiber::forget(fd);
+    close(fd);
+}
+
+void fake_controller::spawn(const char *name, const std::function<void()> &body)
+{
+    ++running;
+    fiber::create(name, [this, body] {
+        body();
+        if (--running == 0)
+            stopped.notify();
+    }, 64 * 1024);
+}
+
+u16 fake_controller::link(const bdaddr_t &peer) const
+{
+    for (auto &entry : links)
+    {
+        if (entry.second == peer)
+            return entry.first;
+    }
+
+    return 0;
+}
+
+void fake_controller::connection_request(const bdaddr_t &peer)
+{
+    u8 params[sizeof(evt_conn_request)];
+    frame evt(params, sizeof(params));
+    evt.write(peer);
+    evt.write_u8(0x08); // gamepad
+    evt.write_u8(0x05); // peripheral
+    evt.write_u8(0x00);
+    evt.write_u8(0x01); // ACL
+    write(event_packet(EVT_CONN_REQUEST, params, evt.size));
+}
+
+void fake_controller::send_acl(u16 handle, const block &l2cap)
+{
+    u8 pkt[1 + sizeof(hci_acl_hdr)];
+    pkt[0] = HCI_ACLDATA_PKT;
+    auto hdr = (hci_acl_hdr *)(pkt + 1);
+
+    usize offset = 0;
+    u16 flags = ACL_START;
+    do
+    {
+        auto size = std::min<usize>(l2cap.size - offset, acl_mtu);
+        hdr->handle = htobs(acl_handle_pack(handle, flags));
+        hdr->dlen = htobs(size);
+
+        iovec parts[] = {{pkt, sizeof(pkt)}, {(void *)(l2cap.data + offset), size}};
+        send(parts, 2);
+
+        offset += size;
+        flags = ACL_CONT;
+    } while (offset < l2cap.size);
+}
+
+void fake_controller::disconnect(u16 handle, u8 reason)
+{
+    links.erase(handle);
+    write(link_event(EVT_DISCONN_COMPLETE, handle, {reason}));
+    links_changed.notify();
+}
+
+void fake_controller::run()
+{
+    u8 pkt[HCI_MAX_FRAME_SIZE];
+    std::vector<std::pair<u16, u16>> completed;
+
+    while (!closing)
+    {
+        fiber::wait_readable(fd);
+        if (closing)
+            return;
+
+        // everything already queued is one batch, answered with a single
+        // completed packets event like a controller that keeps up
+        while (true)
+        {
+            auto size = recv(fd, pkt, sizeof(pkt), MSG_DONTWAIT);
+            if (size == 0)
+                return;
+
+            if (size < 0)
+            {
+                if (errno == EAGAIN)
+                    break;
+                if (errno == EINTR)
+                    continue;
+                error("fake controller read failed");
+            }
+
+            block in(pkt + 1, size - 1);
+            if (pkt[0] == HCI_COMMAND_PKT)
+                command(in);
+            else if (pkt[0] == HCI_ACLDATA_PKT)
+            {
+                auto hdr = in.advance<hci_acl_hdr>();
+                if (!hdr)
+                    continue;
+
+                auto handle = btohs(hdr->handle) & 0xFFF;
+                auto it = completed.begin();
+                while (it != completed.end() && it->first != handle)
+                    ++it;
+                if (it == completed.end())
+                    completed.emplace_back(handle, 1);
+                else
+                    ++it->second;
+
+                if (acl)
+                    acl(handle, btohs(hdr->handle) >> 12 & 0x3, in);
+            }
+        }
+
+        if (completed.empty())
+            continue;
+
+        u8 params[255];
+        frame evt(params, sizeof(params));
+        evt.write_u8(completed.size());
+        for (auto &entry : completed)
+            evt.write_u16(htobs(entry.first));
+        for (auto &entry : completed)
+            evt.write_u16(htobs(entry.second));
+        write(event_packet(EVT_NUM_COMP_PKTS, params, evt.size));
+
+        completed.clear();
+    }
+}
+
+void fake_controller::command(block pkt)
+{
+    auto hdr = pkt.advance<hci_command_hdr>();
+    if (!hdr)
+        return;
+
+    auto opcode = btohs(hdr->opcode);
+
+    u8 params[255];
+    frame rp(params, sizeof(params));
+    rp.write_u8(0x00);
+
+    switch (opcode)
+    {
+    case cmd_opcode_pack(0x01, 0x0001): // inquiry
+        status(opcode, 0x00);
+        inquiry();
+        break;
+
+    case cmd_opcode_pack(0x01, 0x0005): // create connection
+    case cmd_opcode_pack(0x01, 0x0009): // accept connection
+    {
+        auto peer = pkt.advance<bdaddr_t>();
+        if (!peer)
+            return;
+
+        status(opcode, 0x00);
+
+        auto handle = next_handle;
+        auto addr = *peer;
+        next_handle = next_handle % 0xEFF + 1;
+        later({connection_complete(0x00, handle, addr)}, [this, handle, addr] {
+            links[handle] = addr;
+            links_changed.notify();
+        });
+        break;
+    }
+
+    case cmd_opcode_pack(0x01, 0x000A): // reject connection
+    {
+        auto peer = pkt.advance<bdaddr_t>();
+        if (!peer)
+            return;
+
+        status(opcode, 0x00);
+        later({connection_complete(pkt.read_u8(), 0x0000, *peer)});
+        break;
+    }
+
+    case cmd_opcode_pack(0x01, 0x0006): // disconnect
+    {
+        auto handle = btohs(pkt.read_u16());
+        status(opcode, 0x00);
+
+        later({link_event(EVT_DISCONN_COMPLETE, handle, {0x16})}, [this, handle] {
+            links.erase(handle);
+            links_changed.notify();
+        });
+        break;
+    }
+
+    case cmd_opcode_pack(0x01, 0x0011): // authentication requested
+        status(opcode, 0x00);
+        later({link_event(EVT_AUTH_COMPLETE, btohs(pkt.read_u16()))});
+        break;
+
+    case cmd_opcode_pack(0x01, 0x0013): // set connection encryption
+    {
+        auto handle = btohs(pkt.read_u16());
+        auto enable = pkt.read_u8();
+        status(opcode, 0x00);
+        later({link_event(EVT_ENCRYPT_CHANGE, handle, {enable})});
+        break;
+    }
+
+    case cmd_opcode_pack(0x02, 0x0007): // qos setup
+        status(opcode, 0x00);
+        break;
+
+    case cmd_opcode_pack(0x04, 0x0001): // read local version
+        rp.write_u8(0x06);
+        rp.write_u16(htobs(0x0000));
+        rp.write_u8(0x06);
+        rp.write_u16(htobs(0xFFFF));
+        rp.write_u16(htobs(0x0000));
+        complete(opcode, params, rp.size);
+        break;
+
+    case cmd_opcode_pack(0x04, 0x0005): // read buffer size
+        rp.write_u16(htobs(acl_mtu));
+        rp.write_u8(64);
+        rp.write_u16(htobs(acl_buffers));
+        rp.write_u16(htobs(8));
+        complete(opcode, params, rp.size);
+        break;
+
+    case cmd_opcode_pack(0x04, 0x0009): // read bd addr
+        rp.write(address);
+        complete(opcode, params, rp.size);
+        break;
+
+    default:
+        // resets, setters and vendor commands only need to succeed
+        complete(opcode, params, rp.size);
+        break;
+    }
+}
+
+void fake_controller::inquiry()
+{
+    std::vector<std::vector<u8>> events;
+
+    for (usize i = 0; i < peers.size(); ++i)
+    {
+        u8 params[1 + sizeof(extended_inquiry_info)];
+        memset(params, 0, sizeof(params));
+        params[0] = 1;
+
+        auto info = (extended_inquiry_info *)(params + 1);
+        info->bdaddr = peers[i];
+        info->pscan_rep_mode = 0x01;
+        info->dev_class[0] = 0x08;
+        info->dev_class[1] = 0x05;
+        info->rssi = -40;
+
+        auto name = "fake peer " + std::to_string(i);
+        info->data[0] = name.size() + 1;
+        info->data[1] = 0x09; // complete local name
+        memcpy(info->data + 2, name.data(), name.size());
+
+        events.push_back(event_packet(EVT_EXTENDED_INQUIRY_RESULT, params, sizeof(params)));
+    }
+
+    u8 done = 0x00;
+    events.push_back(event_packet(EVT_INQUIRY_COMPLETE, &done, 1));
+    later(events);
+}
+
+void fake_controller::write(const std::vector<u8> &pkt)
+{
+    iovec part = {(void *)pkt.data(), pkt.size()};
+    send(&part, 1);
+}
+
+// like adapter::send, whatever the socket won't take yet goes to the
+// backlog and nothing overtakes it
+void fake_controller::send(const iovec *parts, usize count)
+{
+    if (backlog.empty())
+    {
+        if (writev(fd, parts, count) >= 0)
+            return;
+
+        if (errno != EAGAIN && errno != EINTR)
+            error("fake controller write failed");
+    }
+
+    auto &pkt = backlog.emplace_back();
+    for (usize i = 0; i < count; ++i)
+    {
+        auto data = (const u8 *)parts[i].iov_base;
+        pkt.insert(pkt.end(), data, data + parts[i].iov_len);
+    }
+
+    backlogged.notify();
+}
+
+// packets keep their boundaries on the socketpair, so each goes out whole
+void fake_controller::write_backlog()
+{
+    while (true)
+    {
+        while (!closing && backlog.empty())
+            backlogged.wait();
+
+        if (closing)
+            return;
+
+        fiber::wait_writable(fd);
+        if (closing)
+            return;
+
+        while (!backlog.empty())
+        {
+            auto &pkt = backlog.front();
+            if (::write(fd, pkt.data(), pkt.size()) < 0)
+            {
+                if (errno == EAGAIN)
+                    break;
+                if (errno == EINTR)
+                    continue;
+                error("fake controller write failed");
+            }
+
+            backlog.pop_front();
+        }
+    }
+}
+
+// in a fiber of their own, so the command status always gets to the host
+// first and nobody waiting on it misses the event
+void fake_controller::later(std::vector<std::vector<u8>> events, const std::function<void()> &then)
+{
+    spawn("fake controller event", [this, events = std::move(events), then] {
+        fiber::delay(event_delay);
+        if (closing)
+            return;
+
+        for (auto &pkt : events)
+            write(pkt);
+
+        if (then)
+            then();
+    });
+}
+
+void fake_controller::complete(u16 opcode, const u8 *params, usize size)
+{
+    u8 evt[3 + 255];
+    evt[0] = command_credits;
+    evt[1] = opcode & 0xFF;
+    evt[2] = opcode >> 8;
+    memcpy(evt + 3, params, size);
+    write(event_packet(EVT_CMD_COMPLETE, evt, 3 + size));
+}
+
+void fake_controller::status(u16 opcode, u8 status)
+{
+    u8 evt[] = {status, command_credits, (u8)(opcode & 0xFF), (u8)(opcode >> 8)};
+    write(event_packet(EVT_CMD_STATUS, evt, sizeof(evt)));
+}
+
+} // namespace bt
@@ -0,0 +1,86 @@
+#ifndef BT_FAKE_CONTROLLER_H
+#define BT_FAKE_CONTROLLER_H
+
+#include "fiber.h"
+#include "common.h"
+
+#include <deque>
+#include <sys/uio.h>
+
+namespace bt
+{
+
+// stands in for a dongle at the other end of a socketpair, hand host_fd()
+// to adapter::transport. it answers the commands adapter and device send,
+// completes ACL packets as soon as it reads them and reports peers to
+// inquiries. runs as fibers on the thread that created it
+class fake_controller
+{
+public:
+    bdaddr_t address = {{0x00, 0x00, 0x00, 0xce, 0xfa, 0x00}};
+    u16 acl_mtu = 1021;
+    u16 acl_buffers = 8;
+    u8 command_credits = 1;
+    // how long connection, security and inquiry events trail the command
+    // status that started them
+    usize event_delay = 1;
+
+    // every inquiry reports these with extended inquiry results
+    std::vector<bdaddr_t> peers;
+
+    // called with each ACL packet the host sends, boundary is ACL_START
+    // or ACL_CONT and data starts after the ACL header
+    std::function<void(u16 handle, u8 boundary, block data)> acl;
+
+    fake_controller();
+    // stops its fibers and waits for them like adapter::~adapter, events
+    // still on their way are dropped
+    ~fake_controller();
+
+    // notified whenever a link comes up or goes down
+    condition links_changed;
+
+    int host_fd() const { return host; }
+
+    // the handle of the link to peer once the host has been told it's up,
+    // otherwise 0
+    u16 link(const bdaddr_t &peer) const;
+
+    // the remote side of a link
+    void connection_request(const bdaddr_t &peer);
+    void send_acl(u16 handle, const block &l2cap);
+    void disconnect(u16 handle, u8 reason);
+
+private:
+    int fd;
+    int host;
+
+    u16 next_handle = 0x0001;
+    std::unordered_map<u16, bdaddr_t> links;
+
+    // packets the host hasn't made room for yet, in order
+    std::deque<std::vector<u8>> backlog;
+    condition backlogged;
+
+    // set by the destructor, every fiber returns once it sees it and the
+    // last one notifies stopped
+    bool closing = false;
+    usize running = 0;
+    condition stopped;
+
+    void spawn(const char *name, const std::function<void()> &body);
+    void run();
+    void command(block pkt);
+    void inquiry();
+
+    void write(const std::vector<u8> &pkt);
+    void send(const iovec *parts, usize count);
+    void write_backlog();
+    void later(std::vector<std::vector<u8>> events, const std::function<void()> &then = nullptr);
+    void complete(u16 opcode, const u8 *params, usize size);
+    void status(u16 opcode, u8 status);
+};
+
+} // namespace bt
+
+#endif
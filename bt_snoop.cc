@@ -0,0 +1,159 @@
+#include "bt_snoop.h"
+
+#include <chrono>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+namespace bt
+{
+
+// microseconds from year 0 to the unix epoch
+static const i64 BTSNOOP_UNIX_EPOCH = 0x00dcddb30f2f8000;
+static const u32 BTSNOOP_H4 = 1002;
+static const usize WRITE_BATCH = 64 * 1024;
+
+static void put_u32(u8 *out, u32 value)
+{
+    value = htonl(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+static void put_i64(u8 *out, i64 value)
+{
+    put_u32(out, (u64)value >> 32);
+    put_u32(out + 4, (u32)value);
+}
+
+static i64 steady_us()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+snoop::snoop(const char *path) : head(0), tail(0), stopping(false)
+{
+    using namespace std::chrono;
+
+    fd = open(path, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        error(std::string("failed to open capture ") + path);
+
+    u8 header[16] = {'b', 't', 's', 'n', 'o', 'o', 'p', 0};
+    put_u32(header + 8, 1);
+    put_u32(header + 12, BTSNOOP_H4);
+    write_out(header, sizeof(header));
+
+    auto wall = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+    epoch = BTSNOOP_UNIX_EPOCH + wall - steady_us();
+
+    slots = new slot[SLOTS];
+    writer = std::thread([this] {
+        while (true)
+        {
+            auto stop = stopping.load(std::memory_order_acquire);
+            drain();
+            if (stop)
+                break;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+}
+
+snoop::~snoop()
+{
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+
+    close(fd);
+    delete[] slots;
+}
+
+void snoop::record(bool received, const iovec *parts, usize count)
+{
+    auto position = head.load(std::memory_order_relaxed);
+    if (position - tail.load(std::memory_order_acquire) == SLOTS)
+    {
+        ++drops;
+        return;
+    }
+
+    auto &out = slots[position % SLOTS];
+    out.length = 0;
+    out.size = 0;
+    for (usize i = 0; i < count; ++i)
+    {
+        out.length += parts[i].iov_len;
+        auto size = std::min(parts[i].iov_len, sizeof(out.data) - out.size);
+        memcpy(out.data + out.size, parts[i].iov_base, size);
+        out.size += size;
+    }
+
+    // bit 0 is the direction, bit 1 marks commands and events
+    auto type = out.size > 0 ? out.data[0] : 0;
+    out.flags = (received ? 0x01 : 0x00) |
+                (type == HCI_COMMAND_PKT || type == HCI_EVENT_PKT ? 0x02 : 0x00);
+    out.drops = drops;
+    out.timestamp = steady_us();
+
+    head.store(position + 1, std::memory_order_release);
+}
+
+// writer thread, batches records so a busy link costs few syscalls
+void snoop::drain()
+{
+    auto position = tail.load(std::memory_order_relaxed);
+    auto end = head.load(std::memory_order_acquire);
+
+    for (; position != end; ++position)
+    {
+        auto &in = slots[position % SLOTS];
+
+        u8 header[24];
+        put_u32(header, in.length);
+        put_u32(header + 4, in.size);
+        put_u32(header + 8, in.flags);
+        put_u32(header + 12, in.drops);
+        put_i64(header + 16, epoch + in.timestamp);
+
+        batch.insert(batch.end(), header, header + sizeof(header));
+        batch.insert(batch.end(), in.data, in.data + in.size);
+        tail.store(position + 1, std::memory_order_release);
+
+        if (batch.size() >= WRITE_BATCH)
+        {
+            write_out(batch.data(), batch.size());
+            batch.clear();
+        }
+    }
+
+    if (!batch.empty())
+    {
+        write_out(batch.data(), batch.size());
+        batch.clear();
+    }
+}
+
+void snoop::write_out(const u8 *data, usize size)
+{
+    while (size > 0)
+    {
+        auto result = ::write(fd, data, size);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // losing the capture must not take the adapter down
+            perror("capture write failed");
+            return;
+        }
+
+        data += result;
+        size -= result;
+    }
+}
+
+} // namespace bt
@@ -0,0 +1,66 @@
+#ifndef BT_SNOOP_H
+#define BT_SNOOP_H
+
+#include "common.h"
+
+#include <atomic>
+#include <thread>
+#include <sys/uio.h>
+
+namespace bt
+{
+
+// records HCI packets to a btsnoop file with H4 framing, which wireshark
+// opens. record only copies the packet into a ring, a writer thread turns
+// it into a btsnoop record and writes it out
+class snoop
+{
+public:
+    snoop(const char *path);
+    ~snoop();
+
+    // called from the adapter's thread only. never blocks, packets are
+    // dropped and counted in the file while the ring is full
+    void record(bool received, const iovec *parts, usize count);
+
+    void record(bool received, const u8 *data, usize size)
+    {
+        iovec part = {(void *)data, size};
+        record(received, &part, 1);
+    }
+
+private:
+    static const usize SLOTS = 512;
+
+    struct slot
+    {
+        i64 timestamp;
+        // length is the packet's, size what fit in data
+        u32 length;
+        u32 size;
+        u32 flags;
+        u32 drops;
+        u8 data[HCI_MAX_FRAME_SIZE];
+    };
+
+    slot *slots;
+    // head is only written by record and tail by the writer
+    alignas(64) std::atomic<usize> head;
+    alignas(64) std::atomic<usize> tail;
+    u32 drops = 0;
+
+    std::atomic<bool> stopping;
+    int fd;
+    // steady_clock to btsnoop time, microseconds since year 0
+    i64 epoch;
+    // only touched by the writer thread
+    std::vector<u8> batch;
+    std::thread writer;
+
+    void drain();
+    void write_out(const u8 *data, usize size);
+};
+
+} // namespace bt
+
+#endif
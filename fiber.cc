@@ -1,205 +1,1521 @@
 #include "fiber.h"
 
+#include <atomic>
 #include <cassert>
-#include <mutex>
+#include <chrono>
+#include <future>
 #include <thread>
-#include <condition_variable>
 
-#include <setjmp.h>
-#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <signal.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 
 #ifdef DEBUG
 #include <valgrind/valgrind.h>
 #endif
 
 // #define FIBER_DEBUG
+// #define FIBER_UCONTEXT
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#define FIBER_UCONTEXT
+#endif
+
+#ifdef FIBER_UCONTEXT
+#include <setjmp.h>
+#include <ucontext.h>
+#endif
+
+static const usize CONTEXT_POOL_SIZE = 64;
+static const usize INPUT_QUEUE_SIZE = 256;
+static const usize MAX_SCHEDULERS = 64;
+static const usize MAX_SELECT = 8;
+
+using fiber_clock = std::chrono::steady_clock;
+
+// cycle counter used for the scheduler statistics, a clock_gettime per
+// switch would cost more than the switch itself
+static u64 ticks()
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    u64 value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(fiber_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// calibrated against the steady clock over the life of the process
+static double ns_per_tick()
+{
+#if defined(__x86_64__)
+    static const auto start_time = fiber_clock::now();
+    static const auto start_ticks = ticks();
+
+    auto elapsed = ticks() - start_ticks;
+    if (elapsed == 0)
+        return 1;
+
+    return std::chrono::duration<double, std::nano>(fiber_clock::now() - start_time).count() / elapsed;
+#elif defined(__aarch64__)
+    u64 frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    return 1e9 / frequency;
+#else
+    return 1;
+#endif
+}
+
+static u64 to_ns(u64 count)
+{
+    return count * ns_per_tick();
+}
 
-static const unsigned int STACK_SIZE = 1024 * 1024;
-// static const unsigned int STACK_SIZE = 1024 * 256;
+struct fiber_counters
+{
+    std::string name;
+    usize created = 0;
+    usize live = 0;
+    usize switches = 0;
+    u64 run_ticks = 0;
+    u64 wait_ticks = 0;
+};
 
 struct fiber_context;
+struct selection;
 
 struct identity
 {
+#ifdef FIBER_UCONTEXT
     jmp_buf *state;
+#else
+    void *state;
+#endif
+    // address of the coroutine handle of an async, null for stackful fibers
+    void *coroutine;
+    // set on the stand-ins a fiber in select leaves in each source
+    selection *select;
+    identity *next;
+    fiber_counters *stats;
+    fiber::priority prio;
+    // steady clock ns at which a delay ends, 0 while the fiber isn't in one
+    u64 deadline;
+    // when the fiber last gave up the thread, and when it was made ready
+    // again. readied is the start of the time slice in which notify ran,
+    // so switches cost a single clock read
+    u64 parked;
+    u64 readied;
 #ifdef FIBER_DEBUG
     usize index;
     std::string name;
 #endif
 };
 
-struct fiber_context
+static usize page_size()
 {
-    char stack[STACK_SIZE];
+    static const usize size = sysconf(_SC_PAGESIZE);
+    return size;
+}
 
-#ifdef DEBUG
-    usize valgrind_handle;
+// stacks are mapped with a PROT_NONE guard page below them, so an overflow
+// faults instead of corrupting the heap. pages are only committed when the
+// fiber first touches them.
+struct fiber_context
+{
+    char *stack;
+    usize size;
 
-    fiber_context()
+    fiber_context(usize size) : size(size)
     {
-        valgrind_handle = VALGRIND_STACK_REGISTER(stack, stack + STACK_SIZE);
+        auto base = (char *)mmap(nullptr, size + page_size(), PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (base == MAP_FAILED)
+            error("failed to map fiber stack");
+
+        if (mprotect(base, page_size(), PROT_NONE) < 0)
+            error("failed to protect fiber stack");
+
+        stack = base + page_size();
+
+#ifdef DEBUG
+        valgrind_handle = VALGRIND_STACK_REGISTER(stack, stack + size);
+#endif
     }
 
     ~fiber_context()
     {
+#ifdef DEBUG
         VALGRIND_STACK_DEREGISTER(valgrind_handle);
+#endif
+
+        munmap(stack - page_size(), size + page_size());
     }
+
+#ifdef DEBUG
+    usize valgrind_handle;
 #endif
 };
 
+#ifndef FIBER_UCONTEXT
+// saves the callee-saved registers on the current stack, stores the stack
+// pointer in *save, then restores the registers saved on the stack at load
+extern "C" void fiber_switch(void **save, void *load);
+// first return address of a new fiber: calls entry(arg0, arg1)
+extern "C" void fiber_start();
+
+#if defined(__x86_64__)
+// r15 r14 r13 r12 rbx rbp rip
+static const usize FRAME_SIZE = 7;
+static const usize FRAME_ENTRY = 1;
+static const usize FRAME_ARG1 = 2;
+static const usize FRAME_ARG0 = 3;
+static const usize FRAME_RETURN = 6;
+
+asm(R"(
+    .text
+    .globl fiber_switch
+    .hidden fiber_switch
+    .type fiber_switch, @function
+fiber_switch:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    retq
+    .size fiber_switch, .-fiber_switch
+
+    .globl fiber_start
+    .hidden fiber_start
+    .type fiber_start, @function
+fiber_start:
+    movq %r12, %rdi
+    movq %r13, %rsi
+    callq *%r14
+    ud2
+    .size fiber_start, .-fiber_start
+)");
+#elif defined(__aarch64__)
+// x19-x28 x29 x30 d8-d15
+static const usize FRAME_SIZE = 20;
+static const usize FRAME_ARG0 = 0;
+static const usize FRAME_ARG1 = 1;
+static const usize FRAME_ENTRY = 2;
+static const usize FRAME_RETURN = 11;
+
+asm(R"(
+    .text
+    .globl fiber_switch
+    .hidden fiber_switch
+    .type fiber_switch, %function
+fiber_switch:
+    sub sp, sp, #160
+    stp x19, x20, [sp, #0]
+    stp x21, x22, [sp, #16]
+    stp x23, x24, [sp, #32]
+    stp x25, x26, [sp, #48]
+    stp x27, x28, [sp, #64]
+    stp x29, x30, [sp, #80]
+    stp d8, d9, [sp, #96]
+    stp d10, d11, [sp, #112]
+    stp d12, d13, [sp, #128]
+    stp d14, d15, [sp, #144]
+    mov x2, sp
+    str x2, [x0]
+    mov sp, x1
+    ldp x19, x20, [sp, #0]
+    ldp x21, x22, [sp, #16]
+    ldp x23, x24, [sp, #32]
+    ldp x25, x26, [sp, #48]
+    ldp x27, x28, [sp, #64]
+    ldp x29, x30, [sp, #80]
+    ldp d8, d9, [sp, #96]
+    ldp d10, d11, [sp, #112]
+    ldp d12, d13, [sp, #128]
+    ldp d14, d15, [sp, #144]
+    add sp, sp, #160
+    ret
+    .size fiber_switch, .-fiber_switch
+
+    .globl fiber_start
+    .hidden fiber_start
+    .type fiber_start, %function
+fiber_start:
+    mov x0, x19
+    mov x1, x20
+    blr x21
+    brk #0
+    .size fiber_start, .-fiber_start
+)");
+#endif
+#endif
+
 #ifdef FIBER_DEBUG
 #define fiber_log(...) printf(__VA_ARGS__)
-static usize next_index = 1;
+static std::atomic<usize> next_index(1);
 #else
 #define fiber_log(...)
 #endif
 
-static usize active_fiber_count;
+static const usize NOT_QUEUED = ~(usize)0;
+
+// a timed wait, on the stack of the waiting fiber. if it expires while the
+// fiber is still waiting, the fiber is taken off the condition and made
+// ready with timed_out set
+struct timer
+{
+    fiber_clock::time_point deadline;
+    usize sequence;
+    condition *source;
+    identity *waiter;
+    usize index = NOT_QUEUED;
+    bool timed_out = false;
+
+    bool operator<(const timer &other) const
+    {
+        if (deadline != other.deadline)
+            return deadline < other.deadline;
+        return sequence < other.sequence;
+    }
+
+    void expire();
+};
+
+// a fiber parked in select. each source's wait list holds a stand-in for
+// it, and the first one to be woken takes the others out
+struct selection
+{
+    identity *owner;
+    const fiber::wait_source *sources;
+    usize count;
+    // the last one waits on timeout, which only the deadline's timer wakes
+    identity proxies[MAX_SELECT + 1];
+    condition timeout;
+    usize fired = NOT_QUEUED;
+
+    void arm(usize i, condition *cv);
+    identity *claim(identity *proxy);
+};
+
+// binary min-heap that keeps each timer's position in it, so a wait that
+// is notified in time can take its timer out. ties fire in the order they
+// were scheduled
+struct timer_heap
+{
+    std::vector<timer *> items;
+
+    bool empty() const { return items.empty(); }
+
+    timer *top() const { return items.front(); }
+
+    void push(timer *t)
+    {
+        t->index = items.size();
+        items.push_back(t);
+        sift_up(t->index);
+    }
+
+    void remove(timer *t)
+    {
+        auto last = items.back();
+        items.pop_back();
+
+        if (last != t)
+        {
+            items[t->index] = last;
+            last->index = t->index;
+            sift_up(last->index);
+            sift_down(last->index);
+        }
+
+        t->index = NOT_QUEUED;
+    }
+
+    void sift_up(usize i)
+    {
+        while (i > 0)
+        {
+            auto parent = (i - 1) / 2;
+            if (!(*items[i] < *items[parent]))
+                break;
+
+            swap(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(usize i)
+    {
+        while (true)
+        {
+            auto least = i;
+            auto left = 2 * i + 1;
+            auto right = left + 1;
+
+            if (left < items.size() && *items[left] < *items[least])
+                least = left;
+            if (right < items.size() && *items[right] < *items[least])
+                least = right;
+
+            if (least == i)
+                break;
+
+            swap(i, least);
+            i = least;
+        }
+    }
+
+    void swap(usize a, usize b)
+    {
+        std::swap(items[a], items[b]);
+        items[a]->index = a;
+        items[b]->index = b;
+    }
+};
+
+// bounded multi-producer single-consumer ring for fiber::input. a cell's
+// sequence is pos while it is free for the producer claiming pos, and
+// pos + 1 once that producer has filled it
+struct input_queue
+{
+    struct cell
+    {
+        std::atomic<usize> sequence;
+        std::function<void()> run;
+    };
+
+    cell cells[INPUT_QUEUE_SIZE];
+
+    alignas(64) std::atomic<usize> tail;
+    alignas(64) usize head;
+
+    input_queue() : tail(0), head(0)
+    {
+        for (usize i = 0; i < INPUT_QUEUE_SIZE; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // called from any thread. fails only if the ring is full
+    bool push(const std::function<void()> &run)
+    {
+        auto pos = tail.load(std::memory_order_relaxed);
+
+        while (true)
+        {
+            auto &c = cells[pos % INPUT_QUEUE_SIZE];
+            auto diff = (intptr_t)c.sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    c.run = run;
+                    c.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    // called from the scheduler thread only
+    bool pop(std::function<void()> *out)
+    {
+        auto &c = cells[head % INPUT_QUEUE_SIZE];
+        if (c.sequence.load(std::memory_order_acquire) != head + 1)
+            return false;
+
+        *out = std::move(c.run);
+        c.run = nullptr;
+        c.sequence.store(head + INPUT_QUEUE_SIZE, std::memory_order_release);
+        ++head;
+        return true;
+    }
+};
+
+// fibers ready to run, see fiber::priority
+struct run_queue
+{
+    wait_list deadlines;
+    wait_list lanes[fiber::PRIORITY_COUNT];
+    usize size = 0;
+
+    bool empty() const { return size == 0; }
+
+    void push(identity *id, fiber::priority prio)
+    {
+        ++size;
+
+        if (prio != fiber::priority::high || id->deadline == 0)
+        {
+            lanes[(usize)prio].push(id);
+            return;
+        }
+
+        auto link = &deadlines.head;
+        while (*link != nullptr && (*link)->deadline <= id->deadline)
+            link = &(*link)->next;
+
+        id->next = *link;
+        *link = id;
+        if (id->next == nullptr)
+            deadlines.tail = id;
+
+        ++deadlines.size;
+    }
+
+    identity *pop()
+    {
+        --size;
+
+        if (!deadlines.empty())
+            return deadlines.pop();
+
+        for (auto &lane : lanes)
+        {
+            if (!lane.empty())
+                return lane.pop();
+        }
+
+        return nullptr;
+    }
+};
+
+// each thread that creates fibers gets its own scheduler, and a fiber only
+// ever runs on the thread it was created on. wake_fd is an eventfd written
+// by fiber::input and timer_fd is armed for the earliest timer deadline,
+// every other fd in the epoll set is registered one-shot by
+// fiber::wait_readable and fiber::wait_writable
+struct fiber::scheduler
+{
+    usize active_fiber_count = 0;
+
+    identity anchor;
+    identity current;
+
+    run_queue ready_queue;
+    // asyncs that were notified, resumed on the anchor stack by fiber::run
+    wait_list resumable;
+
+    fiber_context *cleanup = nullptr;
+    std::vector<fiber_context *> context_pool;
+
+    // timed waits, earliest deadline first
+    timer_heap timers;
+    usize next_timer_sequence = 0;
+    // when the earliest timer is due in ticks, so switches can fire it
+    // without reading the clock
+    u64 timer_ticks = ~(u64)0;
+    // ns_per_tick as of the last poll, it reads the clock itself
+    double tick_ns;
+
+    // in virtual clock mode time stands still while fibers run, and jumps
+    // to the next timer once they're all blocked and no fd is ready
+    bool virtual_clock = false;
+    fiber_clock::time_point virtual_now;
+
+    int fd;
+    int wake_fd;
+    int timer_fd;
+    fiber_clock::time_point armed;
+
+    // an fd has a single registration, armed for whichever directions
+    // still have fibers parked on them
+    struct polled_fd
+    {
+        condition readable;
+        condition writable;
+    };
+
+    std::unordered_map<int, polled_fd> polled;
+
+    input_queue inputs;
+    // set by the first producer after the queue was last drained, so a
+    // burst of inputs costs a single eventfd write
+    std::atomic<bool> wake_pending;
+
+    std::unordered_map<std::string, fiber_counters> stats;
+    u64 resumed;
+    usize ready_depth[16] = {0};
+    // log2 buckets of ticks, converted to ns by fiber::stats
+    usize latency[32] = {0};
+    std::atomic<bool> dump_requested;
+
+    scheduler();
+    ~scheduler();
+
+    void wake()
+    {
+        u64 value = 1;
+        ::write(wake_fd, &value, sizeof(value));
+    }
+
+    void add(int target)
+    {
+        epoll_event evt = {0};
+        evt.events = EPOLLIN;
+        evt.data.fd = target;
+        if (epoll_ctl(fd, EPOLL_CTL_ADD, target, &evt) < 0)
+            error("failed to register fd");
+    }
+};
+
+// the first scheduler, created by whichever thread makes the first fiber
+static std::atomic<fiber::scheduler *> primary;
+
+// every live scheduler, so SIGUSR1 can reach them without taking a lock
+static std::atomic<fiber::scheduler *> schedulers[MAX_SCHEDULERS];
+
+static void request_dump(int)
+{
+    for (auto &slot : schedulers)
+    {
+        auto sched = slot.load();
+        if (sched == nullptr)
+            continue;
+
+        sched->dump_requested.store(true);
+        sched->wake();
+    }
+}
 
-static identity anchor = {
-    .state = nullptr,
+fiber::scheduler::scheduler()
+{
+    anchor.state = nullptr;
+    anchor.coroutine = nullptr;
+    anchor.select = nullptr;
+    anchor.prio = fiber::priority::normal;
+    anchor.deadline = 0;
+    anchor.stats = &stats["anchor"];
+    anchor.stats->name = "anchor";
+    resumed = ticks();
+    tick_ns = ns_per_tick();
 #ifdef FIBER_DEBUG
-    .index = 0,
-    .name = "anchor",
+    anchor.index = 0;
+    anchor.name = "anchor";
 #endif
-};
-static identity current = anchor;
+    current = anchor;
+
+    fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd < 0)
+        error("failed to create epoll");
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0)
+        error("failed to create eventfd");
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd < 0)
+        error("failed to create timerfd");
+
+    add(wake_fd);
+    add(timer_fd);
 
-static std::queue<identity *> ready_queue;
+    wake_pending.store(false);
+    dump_requested.store(false);
 
-static fiber_context *cleanup;
-static std::vector<fiber_context *> context_pool;
+    for (auto &slot : schedulers)
+    {
+        scheduler *empty = nullptr;
+        if (slot.compare_exchange_strong(empty, this))
+            break;
+    }
+
+    scheduler *expected = nullptr;
+    if (primary.compare_exchange_strong(expected, this))
+    {
+        struct sigaction action = {};
+        action.sa_handler = request_dump;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, nullptr);
+    }
+}
+
+// the scheduler is destroyed with the thread, and at exit before static
+// objects that may still try to use it
+static thread_local bool torn_down = false;
+
+fiber::scheduler::~scheduler()
+{
+    torn_down = true;
+
+    for (auto &slot : schedulers)
+    {
+        scheduler *self = this;
+        if (slot.compare_exchange_strong(self, nullptr))
+            break;
+    }
 
-static std::mutex m;
-static std::condition_variable cv;
-static const std::function<void()> *input_func = nullptr;
+    for (auto ctx : context_pool)
+        delete ctx;
+
+    close(timer_fd);
+    close(wake_fd);
+    close(fd);
+}
+
+// constructed on first use since fibers are already created during static
+// initialization
+static fiber::scheduler &local()
+{
+    static thread_local fiber::scheduler instance;
+    return instance;
+}
 
 static void do_cleanup()
 {
-    if (!cleanup)
+    auto &sched = local();
+
+    if (!sched.cleanup)
         return;
 
-    --active_fiber_count;
+    --sched.active_fiber_count;
 
-    if (context_pool.size() < 10)
-        context_pool.push_back(cleanup);
+    if (sched.context_pool.size() < CONTEXT_POOL_SIZE)
+        sched.context_pool.push_back(sched.cleanup);
     else
-        delete cleanup;
+        delete sched.cleanup;
 
-    cleanup = nullptr;
+    sched.cleanup = nullptr;
 }
 
-static void load_state()
+static usize log2_bucket(u64 value, usize count)
+{
+    usize bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    return bucket < count ? bucket : count - 1;
+}
+
+// charges the time since the last switch to the fiber that is giving up
+// the thread, and returns the time the next fiber starts running
+static u64 account(fiber::scheduler &sched)
+{
+    auto now = ticks();
+    sched.current.stats->run_ticks += now - sched.resumed;
+    sched.resumed = now;
+    return now;
+}
+
+static void expire_timers(fiber::scheduler &sched);
+static void track_timers(fiber::scheduler &sched);
+
+// returns the identity that was picked, the anchor if nothing is ready
+static identity *next_state(fiber::scheduler &sched)
 {
-    fiber_log("yield %zu\n", ready_queue.size());
+    fiber_log("yield %zu\n", sched.ready_queue.size);
 
-    if (!ready_queue.empty())
+    auto now = account(sched);
+    if (now >= sched.timer_ticks)
+        expire_timers(sched);
+    ++sched.ready_depth[log2_bucket(sched.ready_queue.size, 16)];
+
+    auto next = &sched.anchor;
+    if (!sched.ready_queue.empty())
     {
-        current = *ready_queue.front();
-        ready_queue.pop();
+        next = sched.ready_queue.pop();
+
+        ++sched.latency[log2_bucket(now - next->readied, 32)];
     }
-    else
-        current = anchor;
 
-    fiber_log("yield to %zu %s\n", current.index, current.name.c_str());
+    sched.current = *next;
+    ++sched.current.stats->switches;
 
-    longjmp(*current.state, 1);
+    fiber_log("yield to %zu %s\n", sched.current.index, sched.current.name.c_str());
+    return next;
 }
 
-static void init_fiber(fiber_context *fib, const std::function<void()> &run)
+static void load_state()
 {
-    fiber_log("return to %zu %s (init)\n", current.index, current.name.c_str());
+    auto &sched = local();
 
-    run();
+    next_state(sched);
 
-    cleanup = fib;
-    fiber_log("yield from %zu %s (destroy)\n", current.index, current.name.c_str());
+#ifdef FIBER_UCONTEXT
+    longjmp(*sched.current.state, 1);
+#else
+    void *discard;
+    fiber_switch(&discard, sched.current.state);
+#endif
+}
+
+static void swap_state(identity *self)
+{
+#ifdef FIBER_UCONTEXT
+    jmp_buf store;
+    self->state = &store;
+    self->parked = ticks();
+
+    if (setjmp(store) == 0)
+        load_state();
+#else
+    auto &sched = local();
+
+    auto next = next_state(sched);
+    self->parked = sched.resumed;
+
+    // a deadline that had already passed when we parked fires in
+    // next_state, and with nothing else ready we are picked again before
+    // our state is saved
+    if (next == self)
+        return;
+
+    fiber_switch(&self->state, sched.current.state);
+#endif
+}
+
+// the caller's function is gone once create returns, so the fiber runs its
+// own copy and whatever it captured by value lives as long as it does. kept
+// out of init_fiber, which never returns to clean up its frame
+static void __attribute__((noinline)) run_body(const std::function<void()> &run)
+{
+    auto body = run;
+    body();
+}
+
+static void init_fiber(fiber_context *fib, const std::function<void()> *run)
+{
+    fiber_log("return to %zu %s (init)\n", local().current.index, local().current.name.c_str());
+
+    run_body(*run);
+
+    --local().current.stats->live;
+    local().cleanup = fib;
+    fiber_log("yield from %zu %s (destroy)\n", local().current.index, local().current.name.c_str());
 
     load_state();
 }
 
+void wait_list::push(identity *id)
+{
+    id->next = nullptr;
+
+    if (tail == nullptr)
+        head = id;
+    else
+        tail->next = id;
+
+    tail = id;
+    ++size;
+}
+
+identity *wait_list::pop()
+{
+    auto id = head;
+
+    head = id->next;
+    if (head == nullptr)
+        tail = nullptr;
+
+    --size;
+    return id;
+}
+
+bool wait_list::remove(identity *id)
+{
+    identity *prev = nullptr;
+    for (auto it = head; it != nullptr; prev = it, it = it->next)
+    {
+        if (it != id)
+            continue;
+
+        if (prev == nullptr)
+            head = it->next;
+        else
+            prev->next = it->next;
+
+        if (tail == it)
+            tail = prev;
+
+        --size;
+        return true;
+    }
+
+    return false;
+}
+
+void selection::arm(usize i, condition *cv)
+{
+    auto &proxy = proxies[i];
+    proxy.coroutine = nullptr;
+    proxy.select = this;
+    proxy.deadline = 0;
+
+    cv->waiting_queue.push(&proxy);
+}
+
+// returns the fiber to wake, or null if another source already fired
+identity *selection::claim(identity *proxy)
+{
+    if (fired != NOT_QUEUED)
+        return nullptr;
+
+    fired = proxy - proxies;
+
+    for (usize i = 0; i <= count; ++i)
+    {
+        if (i == fired)
+            continue;
+
+        if (i == count)
+        {
+            timeout.waiting_queue.remove(&proxies[i]);
+            continue;
+        }
+
+        sources[i].cv->waiting_queue.remove(&proxies[i]);
+        if (sources[i].cancel != nullptr)
+            sources[i].cancel(sources[i].context);
+    }
+
+    owner->deadline = proxy->deadline;
+    return owner;
+}
+
+static void wake(fiber::scheduler &sched, identity *id, fiber::priority boost)
+{
+    if (id->select != nullptr)
+    {
+        id = id->select->claim(id);
+        if (id == nullptr)
+            return;
+    }
+
+    id->readied = sched.resumed;
+
+    if (id->coroutine != nullptr)
+        sched.resumable.push(id);
+    else
+        sched.ready_queue.push(id, id->prio < boost ? id->prio : boost);
+}
+
+void timer::expire()
+{
+    // already notified, it just hasn't run yet
+    if (!source->waiting_queue.remove(waiter))
+        return;
+
+    timed_out = true;
+    waiter->deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    wake(local(), waiter, fiber::priority::low);
+}
+
 void condition::wait()
 {
-    jmp_buf store;
-    identity self = current;
-    self.state = &store;
+    wait_until(fiber::time_point::max());
+}
+
+bool condition::wait_for(usize ms)
+{
+    return wait_until(fiber::after(ms));
+}
+
+bool condition::wait_until(fiber::time_point deadline)
+{
+    auto &sched = local();
+
+    identity self = sched.current;
+    if (self.coroutine != nullptr)
+        error("blocking wait inside an async");
+
+    timer t = {deadline, 0, this, &self};
+    if (deadline != fiber::time_point::max())
+    {
+        t.sequence = sched.next_timer_sequence++;
+        sched.timers.push(&t);
+        if (sched.timers.top() == &t)
+            track_timers(sched);
+    }
 
     fiber_log("yield from %zu %s\n", self.index, self.name.c_str());
 
     waiting_queue.push(&self);
-    if (setjmp(store) == 0)
-        load_state();
+    swap_state(&self);
+
+    sched.current.deadline = 0;
+    if (t.index != NOT_QUEUED)
+        sched.timers.remove(&t);
+
+    auto waited = sched.resumed - self.parked;
+    self.stats->wait_ticks += waited;
+    wait_ticks += waited;
+    ++waits;
 
 #ifdef FIBER_DEBUG
-    assert(self.index == current.index);
+    assert(self.index == sched.current.index);
 #endif
 
     fiber_log("return to %zu %s\n", self.index, self.name.c_str());
     do_cleanup();
+
+    return !t.timed_out;
+}
+
+u64 condition::wait_time()
+{
+    return to_ns(wait_ticks);
+}
+
+// asyncs count their wait from the start of the slice they parked in,
+// which saves a clock read per suspend
+void condition::park(identity *self)
+{
+    fiber_log("suspend %zu %s\n", self->index, self->name.c_str());
+
+    self->parked = local().resumed;
+    waiting_queue.push(self);
+}
+
+void condition::unpark(identity *self)
+{
+    auto waited = local().resumed - self->parked;
+    self->stats->wait_ticks += waited;
+    wait_ticks += waited;
+    ++waits;
 }
 
 void condition::notify()
 {
-    while (!waiting_queue.empty())
+    notify(fiber::priority::low);
+}
+
+void condition::notify(fiber::priority boost)
+{
+    if (waiting_queue.empty())
+        return;
+
+    auto &sched = local();
+
+    // detached first, a select woken here may take its other stand-ins out
+    // of this same list
+    auto waiting = waiting_queue;
+    waiting_queue = wait_list();
+
+    for (auto id = waiting.head; id != nullptr;)
     {
-        ready_queue.push(waiting_queue.front());
-        waiting_queue.pop();
+        auto next = id->next;
+        wake(sched, id, boost);
+        id = next;
     }
 }
 
+// runs an async on the current stack until it next suspends or returns.
+// its run time is charged by whichever account comes next, so resuming
+// costs a single clock read like a fiber switch
+static void resume(fiber::scheduler &sched, identity *id)
+{
+    auto now = account(sched);
+    ++sched.latency[log2_bucket(now - id->readied, 32)];
+
+    sched.current = *id;
+    ++sched.current.stats->switches;
+
+    fiber_log("resume %zu %s\n", id->index, id->name.c_str());
+
+    std::coroutine_handle<>::from_address(id->coroutine).resume();
+}
+
+static void resume_all(fiber::scheduler &sched)
+{
+    if (sched.resumable.empty())
+        return;
+
+    while (!sched.resumable.empty())
+        resume(sched, sched.resumable.pop());
+
+    account(sched);
+    sched.current = sched.anchor;
+}
+
+static fiber_clock::time_point clock_now(fiber::scheduler &sched)
+{
+    return sched.virtual_clock ? sched.virtual_now : fiber_clock::now();
+}
+
+static void track_timers(fiber::scheduler &sched)
+{
+    // virtual time only moves in poll_events, which fires timers itself
+    if (sched.timers.empty() || sched.virtual_clock)
+    {
+        sched.timer_ticks = ~(u64)0;
+        return;
+    }
+
+    auto remaining = std::chrono::duration<double, std::nano>(sched.timers.top()->deadline - fiber_clock::now()).count();
+    sched.timer_ticks = ticks() + (remaining > 0 ? (u64)(remaining / sched.tick_ns) : 0);
+}
+
+static void expire_timers(fiber::scheduler &sched)
+{
+    auto now = clock_now(sched);
+
+    while (!sched.timers.empty() && sched.timers.top()->deadline <= now)
+    {
+        auto t = sched.timers.top();
+        sched.timers.remove(t);
+        t->expire();
+    }
+
+    track_timers(sched);
+}
+
+static void arm_timer(fiber::scheduler &sched)
+{
+    if (sched.timers.empty() || sched.timers.top()->deadline == sched.armed || sched.virtual_clock)
+        return;
+
+    sched.armed = sched.timers.top()->deadline;
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(sched.armed.time_since_epoch()).count();
+
+    itimerspec spec = {0};
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+
+    // a zero it_value would disarm the timer
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+        spec.it_value.tv_nsec = 1;
+
+    if (timerfd_settime(sched.timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+        error("failed to arm timer");
+}
+
+// arms fd one-shot for events and whatever its parked fibers are waiting
+// on, false if it can't be polled
+static bool arm_fd(fiber::scheduler &sched, int fd, u32 events)
+{
+    auto waiter = sched.polled.find(fd);
+    if (waiter != sched.polled.end())
+    {
+        if (waiter->second.readable.waiting() != 0)
+            events |= EPOLLIN;
+        if (waiter->second.writable.waiting() != 0)
+            events |= EPOLLOUT;
+    }
+
+    epoll_event evt = {0};
+    evt.events = events | EPOLLONESHOT;
+    evt.data.fd = fd;
+
+    if (epoll_ctl(sched.fd, EPOLL_CTL_MOD, fd, &evt) < 0 &&
+        (errno != ENOENT || epoll_ctl(sched.fd, EPOLL_CTL_ADD, fd, &evt) < 0))
+    {
+        if (errno == EPERM)
+            return false;
+
+        error("failed to register fd");
+    }
+
+    return true;
+}
+
+static void run_input(fiber::scheduler &sched)
+{
+    sched.wake_pending.store(false);
+
+    std::function<void()> run;
+    for (usize i = 0; i < INPUT_QUEUE_SIZE; ++i)
+    {
+        if (!sched.inputs.pop(&run))
+            return;
+
+        run();
+    }
+
+    // producers kept up with us, come back after the ready fibers have run
+    sched.wake();
+}
+
+static void poll_events(fiber::scheduler &sched, bool block)
+{
+    sched.tick_ns = ns_per_tick();
+    expire_timers(sched);
+    if (!sched.ready_queue.empty() || !sched.resumable.empty())
+        block = false;
+
+    // everything is blocked, skip ahead to the next timer unless an fd
+    // already has something for us
+    bool skip = false;
+    if (block && sched.virtual_clock && !sched.timers.empty())
+    {
+        block = false;
+        skip = true;
+    }
+
+    arm_timer(sched);
+
+    epoll_event evts[16];
+    int count = epoll_wait(sched.fd, evts, 16, block ? -1 : 0);
+    if (count < 0)
+    {
+        if (errno == EINTR)
+            return;
+
+        error("failed to poll");
+    }
+
+    if (skip && count == 0)
+        sched.virtual_now = sched.timers.top()->deadline;
+
+    for (int i = 0; i < count; ++i)
+    {
+        auto fd = evts[i].data.fd;
+
+        if (fd == sched.wake_fd || fd == sched.timer_fd)
+        {
+            u64 discard;
+            ::read(fd, &discard, sizeof(discard));
+
+            if (fd == sched.wake_fd)
+            {
+                if (sched.dump_requested.exchange(false))
+                    fiber::dump_stats(stderr);
+
+                run_input(sched);
+            }
+            else
+                sched.armed = {};
+        }
+        else
+        {
+            auto waiter = sched.polled.find(fd);
+            if (waiter == sched.polled.end())
+                continue;
+
+            auto &entry = waiter->second;
+            auto events = evts[i].events;
+            if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                entry.readable.notify();
+            if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                entry.writable.notify();
+
+            // one-shot disarmed the fd for both directions
+            if (entry.readable.waiting() != 0 || entry.writable.waiting() != 0)
+                arm_fd(sched, fd, 0);
+        }
+    }
+
+    expire_timers(sched);
+}
+
 usize fiber::run()
 {
-    std::unique_lock<std::mutex> lk(m);
+    auto &sched = local();
 
-    while (ready_queue.empty() && input_func == nullptr)
-        cv.wait(lk);
+    poll_events(sched, true);
 
-    if (input_func != nullptr)
+    // fibers and asyncs can wake each other, keep going until both are idle
+    while (!sched.ready_queue.empty() || !sched.resumable.empty())
     {
-        input_func->operator()();
-        input_func = nullptr;
-        cv.notify_all();
+        if (!sched.ready_queue.empty())
+        {
+            fiber_log("yield from anchor\n");
+
+            swap_state(&sched.anchor);
+
+            fiber_log("return to anchor\n");
+
+            sched.current = sched.anchor;
+            do_cleanup();
+        }
+
+        resume_all(sched);
     }
 
-    jmp_buf store;
-    anchor.state = &store;
+    return sched.active_fiber_count;
+}
 
-    fiber_log("yield from anchor\n");
+int fiber::select(std::initializer_list<wait_source> sources, time_point deadline)
+{
+    if (sources.size() > MAX_SELECT)
+        error("too many select sources");
 
-    if (setjmp(store) == 0)
-        load_state();
+    int index = 0;
+    for (auto &src : sources)
+    {
+        if (src.ready)
+            return index;
 
-    fiber_log("return to anchor\n");
+        ++index;
+    }
 
-    current = anchor;
+    auto &sched = local();
+
+    identity self = sched.current;
+    if (self.coroutine != nullptr)
+        error("blocking select inside an async");
+
+    selection sel;
+    sel.owner = &self;
+    sel.sources = sources.begin();
+    sel.count = sources.size();
+
+    for (usize i = 0; i < sel.count; ++i)
+    {
+        auto &src = sel.sources[i];
+        if (src.arm != nullptr)
+            src.arm(src.context);
+
+        sel.arm(i, src.cv);
+    }
+
+    timer t = {deadline, 0, &sel.timeout, &sel.proxies[sel.count]};
+    if (deadline != time_point::max())
+    {
+        sel.arm(sel.count, &sel.timeout);
+
+        t.sequence = sched.next_timer_sequence++;
+        sched.timers.push(&t);
+        if (sched.timers.top() == &t)
+            track_timers(sched);
+    }
+
+    fiber_log("select from %zu %s\n", self.index, self.name.c_str());
+
+    swap_state(&self);
+
+    sched.current.deadline = 0;
+    if (t.index != NOT_QUEUED)
+        sched.timers.remove(&t);
+
+    self.stats->wait_ticks += sched.resumed - self.parked;
+
+    fiber_log("return to %zu %s\n", self.index, self.name.c_str());
     do_cleanup();
 
-    return active_fiber_count;
+    return sel.fired == sel.count ? -1 : (int)sel.fired;
+}
+
+void fiber::set_virtual_clock(bool enabled)
+{
+    auto &sched = local();
+
+    if (enabled && !sched.virtual_clock)
+        sched.virtual_now = fiber_clock::now();
+
+    sched.virtual_clock = enabled;
+    track_timers(sched);
+}
+
+fiber::time_point fiber::now()
+{
+    return clock_now(local());
+}
+
+fiber::time_point fiber::after(usize ms)
+{
+    return clock_now(local()) + std::chrono::milliseconds(ms);
 }
 
 void fiber::delay(usize ms)
 {
-    condition done;
-    std::thread([&] {
-        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
-        fiber::input([&] { done.notify(); });
-    })
-        .detach();
-    done.wait();
+    condition never;
+    never.wait_for(ms);
+}
+
+void fiber::delay_until(time_point deadline, usize spin_us)
+{
+    // a virtual clock doesn't move while we spin
+    if (local().virtual_clock)
+        spin_us = 0;
+
+    condition never;
+    never.wait_until(deadline - std::chrono::microseconds(spin_us));
+
+    if (spin_us == 0)
+        return;
+
+    while (fiber_clock::now() < deadline)
+    {
+#if defined(__x86_64__)
+        _mm_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+}
+
+void fiber::wait_readable(int fd)
+{
+    auto &sched = local();
+
+    // regular files are always ready and can't be polled
+    if (!arm_fd(sched, fd, EPOLLIN))
+        return;
+
+    sched.polled[fd].readable.wait();
+}
+
+void fiber::wait_writable(int fd)
+{
+    auto &sched = local();
+
+    if (!arm_fd(sched, fd, EPOLLOUT))
+        return;
+
+    sched.polled[fd].writable.wait();
+}
+
+void fiber::wake(int fd)
+{
+    auto &sched = local();
+
+    auto waiter = sched.polled.find(fd);
+    if (waiter == sched.polled.end())
+        return;
+
+    waiter->second.readable.notify();
+    waiter->second.writable.notify();
+}
+
+void fiber::forget(int fd)
+{
+    auto &sched = local();
+
+    auto waiter = sched.polled.find(fd);
+    if (waiter == sched.polled.end())
+        return;
+
+    if (waiter->second.readable.waiting() != 0 || waiter->second.writable.waiting() != 0)
+    {
+        errno = EBUSY;
+        error("forgetting an fd fibers wait on");
+    }
+
+    // fails harmlessly if it was never armed
+    epoll_ctl(sched.fd, EPOLL_CTL_DEL, fd, nullptr);
+    sched.polled.erase(waiter);
+}
+
+// only the anchor is counted under its own name
+bool fiber::inside()
+{
+    auto &sched = local();
+    return sched.current.stats != sched.anchor.stats;
+}
+
+bool fiber::alive()
+{
+    return !torn_down;
 }
 
 void fiber::input(const std::function<void()> &run)
 {
-    std::unique_lock<std::mutex> lk(m);
+    auto target = primary.load();
+    if (target == nullptr)
+        target = &local();
+
+    input(target, run);
+}
+
+void fiber::input(scheduler *target, const std::function<void()> &run)
+{
+    while (!target->inputs.push(run))
+        std::this_thread::yield();
+
+    if (!target->wake_pending.exchange(true))
+        target->wake();
+}
+
+fiber::scheduler_stats fiber::stats()
+{
+    auto &sched = local();
+
+    account(sched);
+
+    scheduler_stats result = {};
+    for (auto &pair : sched.stats)
+    {
+        auto &counters = pair.second;
+
+        fiber_stats fib;
+        fib.name = counters.name;
+        fib.created = counters.created;
+        fib.live = counters.live;
+        fib.switches = counters.switches;
+        fib.run_ns = to_ns(counters.run_ticks);
+        fib.wait_ns = to_ns(counters.wait_ticks);
+        result.fibers.push_back(fib);
+    }
 
-    while (input_func != nullptr)
-        cv.wait(lk);
+    memcpy(result.ready_depth, sched.ready_depth, sizeof(result.ready_depth));
 
-    input_func = &run;
-    cv.notify_all();
+    for (usize i = 0; i < 32; ++i)
+        result.latency[log2_bucket(to_ns((u64)1 << i), 32)] += sched.latency[i];
 
-    while (input_func == &run)
-        cv.wait(lk);
+    return result;
+}
+
+void fiber::dump_stats(FILE *out)
+{
+    auto snapshot = stats();
+
+    fprintf(out, "scheduler %p\n", (void *)&local());
+    fprintf(out, "  %-24s %8s %8s %10s %12s %12s\n", "fiber", "live", "created", "switches", "run ms", "wait ms");
+    for (auto &fib : snapshot.fibers)
+    {
+        fprintf(out, "  %-24s %8zu %8zu %10zu %12.3f %12.3f\n", fib.name.c_str(), fib.live, fib.created,
+                fib.switches, fib.run_ns / 1e6, fib.wait_ns / 1e6);
+    }
+
+    fprintf(out, "  ready queue depth:");
+    for (usize i = 0; i < 16; ++i)
+    {
+        if (snapshot.ready_depth[i] != 0)
+            fprintf(out, " <%zu:%zu", (usize)1 << i, snapshot.ready_depth[i]);
+    }
+
+    fprintf(out, "\n  scheduling latency (ns):");
+    for (usize i = 0; i < 32; ++i)
+    {
+        if (snapshot.latency[i] != 0)
+            fprintf(out, " <%zu:%zu", (usize)1 << i, snapshot.latency[i]);
+    }
+
+    fprintf(out, "\n");
+}
+
+fiber::scheduler *fiber::self()
+{
+    return &local();
+}
+
+fiber::scheduler *fiber::worker(const std::string &name, const std::function<void()> &run)
+{
+    std::promise<scheduler *> started;
+    auto result = started.get_future();
+
+    std::thread([&started, name, run] {
+        fiber::create(name, run);
+        started.set_value(&local());
+
+        while (true)
+            fiber::run();
+    })
+        .detach();
+
+    return result.get();
 }
 
 /*
@@ -258,22 +1574,52 @@ bool fiber::fork()
 }
 */
 
-void fiber::create(const std::string &name, const std::function<void()> &run)
+void fiber::create(const std::string &name, const std::function<void()> &run, usize stack_size, priority prio)
 {
-    ++active_fiber_count;
+    auto &sched = local();
 
-    fiber_context *ctx;
-    if (context_pool.empty())
-        ctx = new fiber_context();
-    else
+    ++sched.active_fiber_count;
+
+    stack_size = (stack_size + page_size() - 1) & ~(page_size() - 1);
+
+    fiber_context *ctx = nullptr;
+    for (auto it = sched.context_pool.rbegin(); it != sched.context_pool.rend(); ++it)
     {
-        ctx = context_pool.back();
-        context_pool.pop_back();
+        if ((*it)->size >= stack_size && (*it)->size < stack_size * 2)
+        {
+            ctx = *it;
+            sched.context_pool.erase(std::next(it).base());
+            break;
+        }
     }
 
+    if (ctx == nullptr)
+        ctx = new fiber_context(stack_size);
+
+    auto &stats = sched.stats[name];
+    stats.name = name;
+    ++stats.created;
+    ++stats.live;
+
+    identity self = sched.current;
+    self.readied = account(sched);
+    sched.ready_queue.push(&self, self.prio);
+
+    sched.current.coroutine = nullptr;
+    sched.current.prio = prio;
+    sched.current.deadline = 0;
+    sched.current.stats = &stats;
+    ++stats.switches;
+
+#ifdef FIBER_DEBUG
+    sched.current.index = next_index++;
+    sched.current.name = name;
+#endif
+
+#ifdef FIBER_UCONTEXT
     ucontext_t context;
     context.uc_stack.ss_sp = ctx->stack;
-    context.uc_stack.ss_size = sizeof(ctx->stack);
+    context.uc_stack.ss_size = ctx->size;
     context.uc_stack.ss_flags = 0;
     context.uc_link = nullptr;
 
@@ -281,20 +1627,65 @@ void fiber::create(const std::string &name, const std::function<void()> &run)
     makecontext(&context, (void (*)())init_fiber, 2, ctx, &run);
 
     jmp_buf store;
-    identity self = current;
     self.state = &store;
-    ready_queue.push(&self);
 
     if (setjmp(store) == 0)
-    {
-#ifdef FIBER_DEBUG
-        current.index = next_index++;
-        current.name = name;
-#endif
         setcontext(&context);
-    }
+#else
+    auto frame = (void **)(ctx->stack + ctx->size) - FRAME_SIZE;
+    memset(frame, 0, FRAME_SIZE * sizeof(void *));
+    frame[FRAME_ENTRY] = (void *)init_fiber;
+    frame[FRAME_ARG0] = ctx;
+    frame[FRAME_ARG1] = (void *)&run;
+    frame[FRAME_RETURN] = (void *)fiber_start;
+
+    fiber_switch(&self.state, frame);
+#endif
 
-    fiber_log("return to %zu %s (create)\n", current.index, current.name.c_str());
+    fiber_log("return to %zu %s (create)\n", sched.current.index, sched.current.name.c_str());
 
     do_cleanup();
 }
+
+void fiber::spawn(const std::string &name, async run)
+{
+    auto &sched = local();
+
+    ++sched.active_fiber_count;
+
+    auto &stats = sched.stats[name];
+    stats.name = name;
+    ++stats.created;
+    ++stats.live;
+
+    auto self = new identity();
+    self->state = nullptr;
+    self->coroutine = run.handle.address();
+    self->stats = &stats;
+    self->prio = priority::normal;
+
+#ifdef FIBER_DEBUG
+    self->index = next_index++;
+    self->name = name;
+#endif
+
+    run.handle.promise().self = self;
+
+    identity caller = sched.current;
+    self->readied = account(sched);
+    resume(sched, self);
+
+    account(sched);
+    sched.current = caller;
+}
+
+void fiber::finish(identity *self)
+{
+    auto &sched = local();
+
+    fiber_log("finish %zu %s\n", self->index, self->name.c_str());
+
+    --self->stats->live;
+    --sched.active_fiber_count;
+    delete self;
+}
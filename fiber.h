@@ -4,50 +4,273 @@
 #include "common.h"
 
 #include <queue>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstddef>
+#include <new>
 
 struct identity;
+struct timer;
+struct selection;
+
+class condition;
 
 namespace fiber
 {
 
+struct scheduler;
+
+const usize DEFAULT_STACK_SIZE = 1024 * 1024;
+
+// ready fibers run in class order. high priority fibers woken by a timeout
+// go ahead of the rest, earliest deadline first
+enum class priority : u8
+{
+    high,
+    normal,
+    low,
+};
+
+const usize PRIORITY_COUNT = 3;
+
+// totals for every fiber created with the same name
+struct fiber_stats
+{
+    std::string name;
+    usize created = 0;
+    usize live = 0;
+    usize switches = 0;
+    u64 run_ns = 0;
+    u64 wait_ns = 0;
+};
+
+struct scheduler_stats
+{
+    std::vector<fiber_stats> fibers;
+    // log2 buckets: ready queue depth seen at each switch, and ns between a
+    // fiber being made ready and it running
+    usize ready_depth[16];
+    usize latency[32];
+};
+
+using time_point = std::chrono::steady_clock::time_point;
+
 usize run();
 
+// switches the calling thread's scheduler to a virtual clock that starts
+// at the current time. timers then fire instantly whenever every fiber is
+// blocked, so only use it when all event sources are on this scheduler
+void set_virtual_clock(bool enabled);
+
+time_point now();
+
+// the deadline ms from now, for the wait_until family
+time_point after(usize ms);
+
+// something select can wait on: a condition, with hooks for sources like
+// emitters that have to register where their value goes
+struct wait_source
+{
+    condition *cv;
+    // already fired, select returns it without parking
+    bool ready;
+    void *context;
+    // called before parking, and for every source that didn't fire once
+    // one did
+    void (*arm)(void *context);
+    void (*cancel)(void *context);
+
+    wait_source(condition &cv, bool ready = false, void *context = nullptr, void (*arm)(void *) = nullptr,
+                void (*cancel)(void *) = nullptr)
+        : cv(&cv), ready(ready), context(context), arm(arm), cancel(cancel)
+    {
+    }
+};
+
+// parks until one of the sources fires and returns its index, or -1 if the
+// deadline passes first
+int select(std::initializer_list<wait_source> sources, time_point deadline = time_point::max());
+
 void delay(usize ms);
+// sleeps until spin_us before the deadline, then busy waits out the rest
+// to hide the wakeup latency of the poll
+void delay_until(time_point deadline, usize spin_us = 0);
+
+void wait_readable(int fd);
+void wait_writable(int fd);
+// wakes whatever waits on fd as if it were ready, so its readers and
+// writers can notice they're being shut down
+void wake(int fd);
+// drops fd's registration before it's closed, a later fd with the same
+// number would wake its fibers otherwise. nothing may wait on it
+void forget(int fd);
+
+// false on the thread's own stack, where run is called. a blocking wait
+// needs a fiber to park, outside one run has to be driven instead
+bool inside();
+// false once the thread's scheduler is gone. at exit that happens before
+// static objects are destroyed, and nothing may touch fibers after it
+bool alive();
 
 void input(const std::function<void()> &evt);
+void input(scheduler *target, const std::function<void()> &evt);
+
+scheduler *self();
+
+// starts a thread with a scheduler of its own and creates run there as its
+// first fiber. fibers never move between threads, there is no stealing:
+// conditions, timers and fd registrations belong to one scheduler and
+// aren't locked, and every fiber touches its adapter's state. so several
+// adapters scale by giving each its own worker, and work crosses over with
+// input
+scheduler *worker(const std::string &name, const std::function<void()> &run);
 
-void create(const std::string &name, const std::function<void()> &run);
+// run is copied onto the new fiber's stack before it starts, captures by
+// value stay valid until it returns
+void create(const std::string &name, const std::function<void()> &run, usize stack_size = DEFAULT_STACK_SIZE,
+            priority prio = priority::normal);
+
+scheduler_stats stats();
+void dump_stats(FILE *out);
+
+// called by async when its coroutine returns
+void finish(identity *self);
+
+// a stackless fiber: a coroutine that co_awaits conditions, tasks, promises
+// and emitters instead of blocking on a stack of its own. it runs on the
+// stack of whoever resumes it, so it must never call their blocking waits
+struct async
+{
+    struct promise_type
+    {
+        identity *self = nullptr;
+
+        async get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            finish(self);
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// runs an async until it first suspends, like create does for a fiber
+void spawn(const std::string &name, async run);
 
 } // namespace fiber
 
+// FIFO of parked fibers, linked through the identities on their own stacks
+struct wait_list
+{
+    identity *head = nullptr;
+    identity *tail = nullptr;
+    usize size = 0;
+
+    bool empty() const { return head == nullptr; }
+
+    void push(identity *id);
+    identity *pop();
+    bool remove(identity *id);
+};
+
 class condition
 {
+    friend struct timer;
+    friend struct selection;
+
 public:
-    usize waiting() { return waiting_queue.size(); }
+    struct awaiter
+    {
+        condition *cv;
+        identity *self = nullptr;
+
+        bool await_ready() { return false; }
+
+        void await_suspend(std::coroutine_handle<fiber::async::promise_type> handle)
+        {
+            self = handle.promise().self;
+            cv->park(self);
+        }
+
+        void await_resume() { cv->unpark(self); }
+    };
+
+    usize waiting() { return waiting_queue.size; }
+
+    usize wait_count() { return waits; }
+    u64 wait_time();
 
     void wait();
+    // false if the deadline passed before notify
+    bool wait_for(usize ms);
+    bool wait_until(fiber::time_point deadline);
 
     void notify();
+    // wakes the waiters in at least the given class, for wakeups that are
+    // more urgent than the fibers receiving them
+    void notify(fiber::priority boost);
+
+    awaiter operator co_await() { return {this}; }
 
 private:
-    std::queue<identity *> waiting_queue;
+    wait_list waiting_queue;
+
+    usize waits = 0;
+    u64 wait_ticks = 0;
+
+    void park(identity *self);
+    void unpark(identity *self);
 };
 
 class task
 {
 public:
+    struct awaiter : condition::awaiter
+    {
+        bool resolved;
+
+        bool await_ready() { return resolved; }
+
+        void await_resume()
+        {
+            if (!resolved)
+                condition::awaiter::await_resume();
+        }
+    };
+
     void wait()
     {
         if (!resolved)
             resolve_cv.wait();
     }
 
+    bool wait_for(usize ms) { return wait_until(fiber::after(ms)); }
+
+    bool wait_until(fiber::time_point deadline)
+    {
+        return resolved || resolve_cv.wait_until(deadline);
+    }
+
     void resolve()
     {
         resolved = true;
         resolve_cv.notify();
     }
 
+    awaiter operator co_await() { return {{&resolve_cv}, resolved}; }
+
+    operator fiber::wait_source() { return {resolve_cv, resolved}; }
+
 private:
     bool resolved = false;
     condition resolve_cv;
@@ -57,18 +280,45 @@ template <typename T>
 class promise
 {
 public:
+    struct awaiter : task::awaiter
+    {
+        promise *source;
+
+        T await_resume()
+        {
+            task::awaiter::await_resume();
+            return source->value;
+        }
+    };
+
     T wait()
     {
         t.wait();
         return value;
     }
 
+    bool wait_for(usize ms, T *out) { return wait_until(fiber::after(ms), out); }
+
+    bool wait_until(fiber::time_point deadline, T *out)
+    {
+        if (!t.wait_until(deadline))
+            return false;
+
+        *out = value;
+        return true;
+    }
+
     void resolve(const T &arg)
     {
         value = arg;
         t.resolve();
     }
 
+    awaiter operator co_await() { return {t.operator co_await(), this}; }
+
+    // wait returns at once after select reports this source
+    operator fiber::wait_source() { return t; }
+
 private:
     task t;
     T value;
@@ -77,35 +327,184 @@ private:
 template <typename T>
 class emitter
 {
+    // lives on the stack of the fiber waiting in next, or in the frame of
+    // the async awaiting the emitter
+    struct output
+    {
+        T *value;
+        output *next;
+    };
+
 public:
+    // a callback registered with listen. the node lives wherever the caller
+    // puts it and the callable is stored inline, so listening and emitting
+    // never allocate. sync listeners run inline in emit, the rest each get
+    // a new fiber and should take T by value since the emitted value is
+    // only valid until they first block
+    class listener
+    {
+        friend class emitter;
+
+    public:
+        template <typename F>
+        listener(F &&run, bool sync = false) : sync(sync)
+        {
+            using callable = typename std::decay<F>::type;
+            static_assert(sizeof(callable) <= sizeof(storage), "listener callable is too large");
+            static_assert(alignof(callable) <= alignof(std::max_align_t), "listener callable is overaligned");
+
+            new (storage) callable(std::forward<F>(run));
+            invoke = [](void *self, const T &arg) { (*(callable *)self)(arg); };
+            destroy = [](void *self) { ((callable *)self)->~callable(); };
+        }
+
+        listener(const listener &) = delete;
+        listener &operator=(const listener &) = delete;
+
+        ~listener()
+        {
+            if (source != nullptr)
+                source->unlisten(*this);
+
+            destroy(storage);
+        }
+
+    private:
+        alignas(std::max_align_t) char storage[32];
+        void (*invoke)(void *, const T &);
+        void (*destroy)(void *);
+        bool sync;
+
+        emitter *source = nullptr;
+        listener *next = nullptr;
+    };
+
+    // the coroutine counterpart of next
+    struct awaiter : condition::awaiter
+    {
+        emitter *source;
+        T value;
+        output node;
+
+        void await_suspend(std::coroutine_handle<fiber::async::promise_type> handle)
+        {
+            node = {&value, source->outputs};
+            source->outputs = &node;
+            condition::awaiter::await_suspend(handle);
+        }
+
+        T await_resume()
+        {
+            condition::awaiter::await_resume();
+            return value;
+        }
+    };
+
     usize listening() { return cv.waiting(); }
 
     void next(T *out)
     {
-        outputs.push_back(out);
+        output node = {out, outputs};
+        outputs = &node;
         cv.wait();
     }
 
+    bool next_for(T *out, usize ms) { return next_until(out, fiber::after(ms)); }
+
+    bool next_until(T *out, fiber::time_point deadline)
+    {
+        output node = {out, outputs};
+        outputs = &node;
+        if (cv.wait_until(deadline))
+            return true;
+
+        unlink(&node);
+        return false;
+    }
+
+    // a select source that stores the next emitted value in *out
+    struct selector
+    {
+        emitter *source;
+        output node;
+
+        operator fiber::wait_source() { return {source->cv, false, this, arm, cancel}; }
+
+        static void arm(void *context)
+        {
+            auto self = (selector *)context;
+            self->node.next = self->source->outputs;
+            self->source->outputs = &self->node;
+        }
+
+        static void cancel(void *context)
+        {
+            auto self = (selector *)context;
+            self->source->unlink(&self->node);
+        }
+    };
+
+    selector select_next(T *out) { return {this, {out, nullptr}}; }
+
     void emit(const T &arg)
     {
-        for (auto &fork : forks)
-            fiber::create("emitter", [&] { fork(arg); });
+        for (auto fork = forks; fork != nullptr;)
+        {
+            auto current = fork;
+            fork = fork->next;
 
-        for (auto out : outputs)
-            *out = arg;
+            if (current->sync)
+                current->invoke(current->storage, arg);
+            else
+                fiber::create("emitter", [&] { current->invoke(current->storage, arg); });
+        }
 
-        outputs.clear();
+        for (auto out = outputs; out != nullptr; out = out->next)
+            *out->value = arg;
+
+        outputs = nullptr;
         cv.notify();
     }
 
-    void listen(const std::function<void(T)> &arg)
+    awaiter operator co_await() { return {{&cv}, this}; }
+
+    void listen(listener &arg)
     {
-        forks.push_back(arg);
+        arg.source = this;
+        arg.next = forks;
+        forks = &arg;
+    }
+
+    void unlisten(listener &arg)
+    {
+        for (auto it = &forks; *it != nullptr; it = &(*it)->next)
+        {
+            if (*it == &arg)
+            {
+                *it = arg.next;
+                break;
+            }
+        }
+
+        arg.source = nullptr;
+        arg.next = nullptr;
     }
 
 private:
-    std::vector<std::function<void(T)>> forks;
-    std::vector<T *> outputs;
+    void unlink(output *node)
+    {
+        for (auto it = &outputs; *it != nullptr; it = &(*it)->next)
+        {
+            if (*it == node)
+            {
+                *it = node->next;
+                break;
+            }
+        }
+    }
+
+    listener *forks = nullptr;
+    output *outputs = nullptr;
     condition cv;
 };
 
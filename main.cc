@@ -5,6 +5,8 @@
 #include "bt_command.h"
 #include "bt_channel.h"
 #include "bt_device.h"
+#include "bt_fake_controller.h"
+#include "bt_fake_console.h"
 
 #include "sdp.h"
 
@@ -30,7 +32,25 @@ using std::chrono::nanoseconds;
 // l-bumper,r-bumper,l-stick,r-stick
 // start,back,guide,capture
 
-static bt::adapter hci(0);
+static bt::fake_controller *fake = nullptr;
+
+// BTFAKE runs against an in-process controller instead of hci0, for
+// benchmarking without a dongle
+static bt::adapter &open_adapter()
+{
+    if (getenv("BTFAKE"))
+    {
+        static bt::fake_controller controller;
+        static bt::adapter hci(bt::adapter::transport{controller.host_fd()});
+        fake = &controller;
+        return hci;
+    }
+
+    static bt::adapter hci(0);
+    return hci;
+}
+
+static bt::adapter &hci = open_adapter();
 static bdaddr_t self;
 static bdaddr_t pro_addr;
 static bdaddr_t switch_addr;
@@ -84,45 +104,55 @@ void intel_set_bdaddr(const bdaddr_t &addr)
     hci.reset();
 }
 
-void debug_pro()
+// pages dev and waits for the link to come up authenticated and encrypted.
+// false if the controller stops answering
+static bool open_link(bt::device &dev)
 {
-    hci.start_inquiry(0x9e8b33, 0x30, 255);
-
-    while (true)
-    {
-        block pkt;
-        hci.inquiry_result.next(&pkt);
-
-        pkt.read_u8();
-        auto info = pkt.advance<extended_inquiry_info>();
-        if (info->bdaddr != pro_addr)
-            continue;
-
-        hci.stop_inquiry();
-        break;
-    }
-
-    bt::device pro(hci, pro_addr);
-    pro.connect(0xcc18, 0x02, 0x00, 0x00);
+    if (!dev.connect(0xcc18, 0x02, 0x00, 0x00))
+        return false;
     printf("waiting for connect\n");
-    pro.connected.wait();
+    dev.connected.wait();
 
-    pro.authenticate();
+    if (!dev.authenticate())
+        return false;
     printf("waiting for authenticate\n");
-    pro.authenticated.wait();
+    dev.authenticated.wait();
 
-    pro.encrypt(0x01);
+    if (!dev.encrypt(0x01))
+        return false;
     printf("waiting for encrypt\n");
-    pro.encrypted.wait();
+    dev.encrypted.wait();
+    return true;
+}
+
+// false if either hid channel is refused or times out
+static bool open_hid(bt::device &dev, bt::channel &control, bt::channel &interrupt)
+{
+    return dev.connect(control, 0x11) && dev.connect(interrupt, 0x13) && control.configure() &&
+           interrupt.configure();
+}
+
+void debug_pro()
+{
+    hci.start_inquiry(0x9e8b33, 0x30, 255);
+    hci.wait_discovery(pro_addr, nullptr);
+    hci.stop_inquiry();
+
+    bt::device pro(hci, pro_addr);
+    if (!open_link(pro))
+    {
+        printf("failed to connect\n");
+        return;
+    }
 
     bt::channel hid_control(pro);
     bt::channel hid_interrupt(pro);
 
-    pro.connect(hid_control, 0x11);
-    pro.connect(hid_interrupt, 0x13);
-
-    hid_control.configure();
-    hid_interrupt.configure();
+    if (!open_hid(pro, hid_control, hid_interrupt))
+    {
+        printf("failed to open hid channels\n");
+        return;
+    }
 
     printf("done\n");
 
@@ -307,79 +337,102 @@ struct __attribute__((packed)) report_x30
     }
 };
 
+// scripted reports are paced against absolute deadlines, the last stretch
+// of each is spun out so the poll's wakeup latency doesn't show up
+static const usize REPORT_SPIN_US = 200;
+// how often the simulated console gets an idle 0x30 report
+static const usize IDLE_REPORT_MS = 15;
+
 static condition manual_cv;
 static std::pair<usize, report_x30> manual(0, report_x30());
 static bool run_script = false;
 static bool manual_input = false;
 
+void read_line(const std::string &line)
+{
+    std::stringstream src(line);
+
+    std::string btn;
+    usize delay;
+
+    if (!(src >> btn))
+        return;
+
+    if (btn == "run")
+    {
+        run_script = true;
+    }
+    else
+    {
+        if (!(src >> delay))
+            return;
+
+        if (btn == "up")
+            manual.second.set_LY(0xFFF);
+        else if (btn == "down")
+            manual.second.set_LY(0x000);
+        else if (btn == "left")
+            manual.second.set_LX(0x000);
+        else if (btn == "right")
+            manual.second.set_LX(0xFFF);
+        else if (btn == "a")
+            manual.second.b1 |= 0x08;
+        else if (btn == "b")
+            manual.second.b1 |= 0x04;
+        else if (btn == "x")
+            manual.second.b1 |= 0x02;
+        else if (btn == "y")
+            manual.second.b1 |= 0x01;
+        else if (btn == "minus")
+            manual.second.b2 |= 0x01;
+        else if (btn == "plus")
+            manual.second.b2 |= 0x02;
+        else if (btn == "home")
+            manual.second.b2 |= 0x10;
+        else if (btn == "capture")
+            manual.second.b2 |= 0x20;
+        else if (btn == "l")
+            manual.second.b3 |= 0x40;
+        else if (btn == "r")
+            manual.second.b1 |= 0x40;
+        else if (btn == "zl")
+            manual.second.b3 |= 0x80;
+        else if (btn == "zr")
+            manual.second.b1 |= 0x80;
+        else if (btn == "ls")
+            manual.second.b2 |= 0x08;
+        else if (btn == "rs")
+            manual.second.b2 |= 0x04;
+
+        manual.first = delay;
+        manual_input = true;
+        printf("got manual %d %d %d\n", manual.second.sl1, manual.second.sl2, manual.second.sl3);
+    }
+
+    manual_cv.notify();
+}
+
 void read_console()
 {
-    char *line;
-    usize len;
+    std::string pending;
+    char buffer[256];
 
-    while (getline(&line, &len, stdin) != -1)
+    while (true)
     {
-        std::stringstream src(line);
+        fiber::wait_readable(STDIN_FILENO);
 
-        std::string btn;
-        usize delay;
+        auto result = ::read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (result <= 0)
+            break;
 
-        if (!(src >> btn))
-            continue;
+        pending.append(buffer, result);
 
-        if (btn == "run")
-        {
-            run_script = true;
-        }
-        else
+        usize end;
+        while ((end = pending.find('\n')) != std::string::npos)
         {
-            if (!(src >> delay))
-                continue;
-
-            if (btn == "up")
-                manual.second.set_LY(0xFFF);
-            else if (btn == "down")
-                manual.second.set_LY(0x000);
-            else if (btn == "left")
-                manual.second.set_LX(0x000);
-            else if (btn == "right")
-                manual.second.set_LX(0xFFF);
-            else if (btn == "a")
-                manual.second.b1 |= 0x08;
-            else if (btn == "b")
-                manual.second.b1 |= 0x04;
-            else if (btn == "x")
-                manual.second.b1 |= 0x02;
-            else if (btn == "y")
-                manual.second.b1 |= 0x01;
-            else if (btn == "minus")
-                manual.second.b2 |= 0x01;
-            else if (btn == "plus")
-                manual.second.b2 |= 0x02;
-            else if (btn == "home")
-                manual.second.b2 |= 0x10;
-            else if (btn == "capture")
-                manual.second.b2 |= 0x20;
-            else if (btn == "l")
-                manual.second.b3 |= 0x40;
-            else if (btn == "r")
-                manual.second.b1 |= 0x40;
-            else if (btn == "zl")
-                manual.second.b3 |= 0x80;
-            else if (btn == "zr")
-                manual.second.b1 |= 0x80;
-            else if (btn == "ls")
-                manual.second.b2 |= 0x08;
-            else if (btn == "rs")
-                manual.second.b2 |= 0x04;
-
-            manual.first = delay;
-            manual_input = true;
-            fiber::input([] { manual_cv.notify(); });
-            printf("got manual %d %d %d\n", manual.second.sl1, manual.second.sl2, manual.second.sl3);
+            read_line(pending.substr(0, end));
+            pending.erase(0, end + 1);
         }
-
-        fiber::input([] { manual_cv.notify(); });
     }
 }
 
@@ -461,23 +514,16 @@ void fake_pro()
     bt::channel hid_control(console);
     bt::channel hid_interrupt(console);
 
+    bool opened;
     if (true)
     {
-        console.connect(0xcc18, 0x02, 0x00, 0x00);
-
-        printf("waiting for connect\n");
-        console.connected.wait();
-
-        console.authenticate();
-        printf("waiting for authenticate\n");
-        console.authenticated.wait();
-
-        console.encrypt(0x01);
-        printf("waiting for encrypt\n");
-        console.encrypted.wait();
+        if (!open_link(console))
+        {
+            printf("failed to connect\n");
+            return;
+        }
 
-        console.connect(hid_control, 0x11);
-        console.connect(hid_interrupt, 0x13);
+        opened = console.connect(hid_control, 0x11) && console.connect(hid_interrupt, 0x13);
     }
     else
     {
@@ -488,12 +534,14 @@ void fake_pro()
 
         hci.set_scan_mode(0x02);
 
-        console.accept(hid_control, 0x11);
-        console.accept(hid_interrupt, 0x13);
+        opened = console.accept(hid_control, 0x11) && console.accept(hid_interrupt, 0x13);
     }
 
-    hid_control.configure();
-    hid_interrupt.configure();
+    if (!opened || !hid_control.configure() || !hid_interrupt.configure())
+    {
+        printf("failed to open hid channels\n");
+        return;
+    }
 
     printf("done\n");
 
@@ -501,17 +549,21 @@ void fake_pro()
     // hci.set_page_scan_timing(0x800, 0x012);
     // hci.set_inquiry_scan_timing(0x800, 0x012);
 
-    console.qos_setup(0x00, 0x02, 100 * 60, 100 * 60, 1250, 1250);
+    if (!console.qos_setup(0x00, 0x02, 100 * 60, 100 * 60, 1250, 1250))
+        printf("qos setup failed\n");
 
     u8 report_mode = 0x3f;
+    condition report_mode_changed;
     std::unordered_map<u32, u8> SPI;
 
-    fiber::create("input-loop", [&report_mode, &hid_interrupt] {
+    fiber::create("input-loop", [&report_mode, &report_mode_changed, &hid_interrupt] {
         auto input_mode = &report_mode;
+        auto mode_changed = &report_mode_changed;
         auto c = &hid_interrupt;
 
         usize counter = 0;
         std::deque<std::pair<usize, report_x30>> inputs;
+        fiber::time_point due;
 
         while (true)
         {
@@ -533,7 +585,7 @@ void fake_pro()
                 send_pkt.write_u16(htobs(0x8000)); // rX
                 send_pkt.write_u16(htobs(0x8000)); // rY
                 c->send(block(cmd, send_pkt.size));
-                fiber::delay(250);
+                fiber::select({*mode_changed}, fiber::after(250));
                 continue;
             }
             else if (inputs.size() != 0)
@@ -545,12 +597,31 @@ void fake_pro()
 
                 c->send(block(cmd, send_pkt.size));
                 printf("send %d (%d %d %d)\n", pair.first, pair.second.b1, pair.second.b2, pair.second.b3);
-                fiber::delay(pair.first);
+                due += milliseconds(pair.first);
+                fiber::delay_until(due, REPORT_SPIN_US);
                 inputs.pop_front();
             }
             else
             {
-                manual_cv.wait();
+                // the simulated console times a stream of reports, so
+                // under BTFAKE neutral ones go out while nothing is scripted
+                if (fake)
+                {
+                    due = std::max(due + milliseconds(IDLE_REPORT_MS), fiber::now());
+                    if (!manual_cv.wait_until(due))
+                    {
+                        report_x30 report;
+                        report.timer = counter;
+                        send_pkt.write(report);
+                        c->send(block(cmd, send_pkt.size));
+                        continue;
+                    }
+                }
+                else
+                    manual_cv.wait();
+
+                due = fiber::now();
+
                 if (run_script)
                 {
                     run_script = false;
@@ -579,7 +650,7 @@ void fake_pro()
                 }
             }
         }
-    });
+    }, fiber::DEFAULT_STACK_SIZE, fiber::priority::high);
 
     SPI[0x6000] = 0xFF;
 
@@ -659,6 +730,7 @@ void fake_pro()
             else if (cmdId == 0x03) //set report mode
             {
                 report_mode = pkt.read_u8();
+                report_mode_changed.notify();
                 printf("report mode %02x\n", report_mode);
 
                 reply_pkt.write_u8(0x80);
@@ -772,48 +844,35 @@ void print_block(const block &pkt)
 
 void inspect_pro()
 {
-    hci.start_inquiry(0x9e8b33, 0x30, 255);
-
-    while (true)
-    {
-        block pkt;
-        hci.inquiry_result.next(&pkt);
-
-        pkt.read_u8();
-        auto info = pkt.advance<extended_inquiry_info>();
-
+    // a sync listener sees every response, next would miss the ones that
+    // arrive in the same event
+    emitter<bt::discovery>::listener print([](const bt::discovery &found) {
         char tmp[50];
-        ba2str(&info->bdaddr, tmp);
-        printf("%s\n", tmp);
-
-        if (info->bdaddr != pro_addr)
-            continue;
+        ba2str(&found.addr, tmp);
+        printf("%s %d %s\n", tmp, found.rssi, found.name.c_str());
+    }, true);
 
-        hci.stop_inquiry();
-        break;
-    }
+    hci.inquiry_result.listen(print);
+    hci.start_inquiry(0x9e8b33, 0x30, 255);
+    hci.wait_discovery(pro_addr, nullptr);
+    hci.stop_inquiry();
+    hci.inquiry_result.unlisten(print);
 
     bt::device pro(hci, pro_addr);
-    pro.connect(0xcc18, 0x02, 0x00, 0x00);
-    printf("waiting for connect\n");
-    pro.connected.wait();
-
-    pro.authenticate();
-    printf("waiting for authenticate\n");
-    pro.authenticated.wait();
-
-    pro.encrypt(0x01);
-    printf("waiting for encrypt\n");
-    pro.encrypted.wait();
+    if (!open_link(pro))
+    {
+        printf("failed to connect\n");
+        return;
+    }
 
     bt::channel hid_control(pro);
     bt::channel hid_interrupt(pro);
 
-    pro.connect(hid_control, 0x11);
-    pro.connect(hid_interrupt, 0x13);
-
-    hid_control.configure();
-    hid_interrupt.configure();
+    if (!open_hid(pro, hid_control, hid_interrupt))
+    {
+        printf("failed to open hid channels\n");
+        return;
+    }
 
     block pkt;
     hid_interrupt.data.next(&pkt);
@@ -917,82 +976,69 @@ void pipe(bt::channel &src, bt::channel &dst)
     }
 }
 
-void proxy_pro()
+fiber::async pipe_async(bt::channel &src, bt::channel &dst)
 {
-    // hci.start_inquiry(0x9e8b33, 0x30, 255);
+    while (true)
+    {
+        auto pkt = co_await src.data;
 
-    // while (true)
-    // {
-    //     block pkt;
-    //     hci.inquiry_result.next(&pkt);
+        if (pkt.size == 0)
+            break;
 
-    //     auto count = pkt.read_u8();
-    //     auto info = pkt.advance<extended_inquiry_info>();
-    //     if (info->bdaddr != pro_addr)
-    //         continue;
+        co_await dst.send_async(pkt);
+    }
+}
 
-    //     hci.stop_inquiry();
-    //     break;
-    // }
+void proxy_pro()
+{
+    // hci.start_inquiry(0x9e8b33, 0x30, 255);
+    // hci.wait_discovery(pro_addr, nullptr);
+    // hci.stop_inquiry();
 
     bt::device pro(hci, pro_addr);
-    pro.connect(0xcc18, 0x02, 0x00, 0x00);
-    printf("waiting for connect\n");
-    pro.connected.wait();
-
-    pro.authenticate();
-    printf("waiting for authenticate\n");
-    pro.authenticated.wait();
-
-    pro.encrypt(0x01);
-    printf("waiting for encrypt\n");
-    pro.encrypted.wait();
+    if (!open_link(pro))
+    {
+        printf("failed to connect\n");
+        return;
+    }
 
     // pro.qos_setup(0x00, 0x02, 100 * 60, 100 * 60, 1250, 1250);
 
     bt::channel pro_ctrl(pro);
     bt::channel pro_data(pro);
 
-    pro.connect(pro_ctrl, 0x11);
-    pro.connect(pro_data, 0x13);
-
-    pro_ctrl.configure();
-    pro_data.configure();
+    if (!open_hid(pro, pro_ctrl, pro_data))
+    {
+        printf("failed to open hid channels\n");
+        return;
+    }
 
     printf("acquired pro controller\n");
 
     bt::device console(hci, switch_addr);
-    console.connect(0xcc18, 0x02, 0x00, 0x00);
-
-    printf("waiting for connect\n");
-    console.connected.wait();
-
-    console.authenticate();
-    printf("waiting for authenticate\n");
-    console.authenticated.wait();
-
-    console.encrypt(0x01);
-    printf("waiting for encrypt\n");
-    console.encrypted.wait();
+    if (!open_link(console))
+    {
+        printf("failed to connect\n");
+        return;
+    }
 
     bt::channel console_ctrl(console);
     bt::channel console_data(console);
 
-    console.connect(console_ctrl, 0x11);
-    console.connect(console_data, 0x13);
-
-    console_ctrl.configure();
-    console_data.configure();
+    if (!open_hid(console, console_ctrl, console_data))
+    {
+        printf("failed to open hid channels\n");
+        return;
+    }
 
     // hci.set_scan_mode(0x00);
 
-    console.qos_setup(0x00, 0x02, 100 * 60, 100 * 60, 1250, 1250);
+    if (!console.qos_setup(0x00, 0x02, 100 * 60, 100 * 60, 1250, 1250))
+        printf("qos setup failed\n");
 
     printf("acquired console\n");
 
-    fiber::create("pro -> console", [&] {
-        pipe(pro_data, console_data);
-    });
+    fiber::spawn("pro -> console", pipe_async(pro_data, console_data));
 
     pipe(console_data, pro_data);
 }
@@ -1087,42 +1133,24 @@ void dump_mem(bt::channel &hid, u32 addr, u32 size, const char *out)
 void dump_pro()
 {
     hci.start_inquiry(0x9e8b33, 0x30, 255);
+    hci.wait_discovery(pro_addr, nullptr);
+    hci.stop_inquiry();
 
-    while (true)
+    bt::device pro(hci, pro_addr);
+    if (!open_link(pro))
     {
-        block pkt;
-        hci.inquiry_result.next(&pkt);
-
-        pkt.read_u8();
-        auto info = pkt.advance<extended_inquiry_info>();
-        if (info->bdaddr != pro_addr)
-            continue;
-
-        hci.stop_inquiry();
-        break;
+        printf("failed to connect\n");
+        return;
     }
 
-    bt::device pro(hci, pro_addr);
-    pro.connect(0xcc18, 0x02, 0x00, 0x00);
-    printf("waiting for connect\n");
-    pro.connected.wait();
-
-    pro.authenticate();
-    printf("waiting for authenticate\n");
-    pro.authenticated.wait();
-
-    pro.encrypt(0x01);
-    printf("waiting for encrypt\n");
-    pro.encrypted.wait();
-
     bt::channel hid_control(pro);
     bt::channel hid_interrupt(pro);
 
-    pro.connect(hid_control, 0x11);
-    pro.connect(hid_interrupt, 0x13);
-
-    hid_control.configure();
-    hid_interrupt.configure();
+    if (!open_hid(pro, hid_control, hid_interrupt))
+    {
+        printf("failed to open hid channels\n");
+        return;
+    }
 
     block pkt;
     hid_interrupt.data.next(&pkt);
@@ -1254,8 +1282,8 @@ void sdp_host(bt::device &device)
         printf("waiting for sdp connection\n");
 
         bt::channel sdp(device);
-        device.accept(sdp, 0x01);
-        sdp.configure();
+        if (!device.accept(sdp, 0x01) || !sdp.configure())
+            continue;
 
         printf("got sdp connection\n");
         while (true)
@@ -1362,15 +1390,18 @@ void pair_console()
 
     hci.set_scan_mode(0x02);
 
-    fiber::create("SDP", [&] { sdp_host(console); });
+    fiber::create("SDP", [&] { sdp_host(console); }, fiber::DEFAULT_STACK_SIZE, fiber::priority::low);
 
     printf("connected to console\n");
 
     bt::channel hid_control(console);
     bt::channel hid_interrupt(console);
 
-    console.accept(hid_control, 0x11);
-    console.accept(hid_interrupt, 0x13);
+    if (!console.accept(hid_control, 0x11) || !console.accept(hid_interrupt, 0x13))
+    {
+        printf("failed to accept hid channels\n");
+        return;
+    }
 
     printf("ready console\n");
 
@@ -1378,36 +1409,29 @@ void pair_console()
     // console.disconnect(0x11);
 }
 
-void configure_adapter()
+bool configure_adapter()
 {
     printf("start configure adapter\n");
 
     u8 event_mask[] = {0xFF, 0xFF, 0xFb, 0xFF, 0x07, 0xF8, 0xbf, 0x3d};
     block rsp;
 
-    hci.reset();
-
-    hci.set_event_mask(event_mask);
-    hci.clear_event_filter();
-
-    hci.set_default_link_policy(0x07);
-
-    hci.set_scan_mode(0x02);
     // hci.set_page_scan_timing(0x1000, 0x400);
-    hci.set_page_scan_timing(0x800, 0x200);
     // hci.set_inquiry_scan_timing(0x1000, 0x400);
-    hci.set_inquiry_scan_timing(0x800, 0x200);
-
-    hci.set_inquiry_mode(0x02);
-
-    hci.set_pin_type(0x00);
     // hci.set_simple_pairing_mode(0x01);
-
-    hci.set_local_name("Pro Controller");
     // hci.set_device_class(0x01, 0x1c01);
-    hci.set_device_class(0x02, 0x0025);
-
-    auto version = hci.read_local_version();
+    auto configured = hci.reset() && hci.read_buffer_size() && hci.set_event_mask(event_mask) &&
+                      hci.clear_event_filter() && hci.set_default_link_policy(0x07) && hci.set_scan_mode(0x02) &&
+                      hci.set_page_scan_timing(0x800, 0x200) && hci.set_inquiry_scan_timing(0x800, 0x200) &&
+                      hci.set_inquiry_mode(0x02) && hci.set_pin_type(0x00) && hci.set_local_name("Pro Controller") &&
+                      hci.set_device_class(0x02, 0x0025);
+
+    auto version = configured ? hci.read_local_version() : nullptr;
+    if (version == nullptr)
+    {
+        printf("failed to configure adapter\n");
+        return false;
+    }
 
     printf("hci_version: %02x\n", version->hci_ver);
     printf("hci_revised: %d\n", (int)btohs(version->hci_rev));
@@ -1416,6 +1440,11 @@ void configure_adapter()
     printf("lmp_subvers: %d\n", (int)btohs(version->lmp_subver));
 
     auto localaddr = hci.read_local_address();
+    if (localaddr == nullptr)
+    {
+        printf("failed to configure adapter\n");
+        return false;
+    }
 
     char name[18];
     ba2str(localaddr, name);
@@ -1426,16 +1455,41 @@ void configure_adapter()
     description[1] = 0x09;
     strcpy((char *)description + 2, "Pro Controller");
 
-    hci.set_extended_inquiry_response(0, description);
-
     bt::command set_lap(hci, 0x03, 0x003a);
     set_lap.write_u8(0x01);
     set_lap.write_u8(0x33);
     set_lap.write_u8(0x8b);
     set_lap.write_u8(0x9e);
-    set_lap.run(&rsp);
+    if (!hci.set_extended_inquiry_response(0, description) || !set_lap.run(&rsp))
+    {
+        printf("failed to configure adapter\n");
+        return false;
+    }
 
     printf("finished configure adapter\n");
+    return true;
+}
+
+// 0x30 reports the simulated console times before it prints its numbers
+static const usize BENCH_REPORTS = 400;
+
+// with BTFAKE a simulated switch takes the console's place, fake_pro
+// connects to it and gets timed
+void bench_console()
+{
+    bt::fake_console console(*fake, switch_addr);
+    bt::fake_console::results result;
+    if (!console.measure(BENCH_REPORTS, &result))
+    {
+        printf("console bench timed out\n");
+        exit(1);
+    }
+
+    printf("handshake:       %.3f ms\n", result.handshake_ms);
+    printf("first report:    %.3f ms\n", result.first_report_ms);
+    printf("report interval: %.1f us mean, %.1f us jitter, %.1f us max over %zu\n", result.interval_mean_us,
+           result.interval_jitter_us, result.interval_max_us, result.reports);
+    exit(0);
 }
 
 int main(int argc, char **argv)
@@ -1450,13 +1504,19 @@ int main(int argc, char **argv)
     str2ba("b8:8a:ec:91:17:c2", &switch_addr); // my switch
     // str2ba("04:03:D6:25:A5:37", &switch_addr); // grant's
 
+    if (auto path = getenv("BTSNOOP"))
+        hci.capture(path);
+
     // fiber::create("reset", [] { csr_set_bdaddr(pro_addr); });
     fiber::create("main", [] {
-        configure_adapter();
-        fake_pro();
+        if (configure_adapter())
+            fake_pro();
     });
 
-    std::thread(read_console).detach();
+    if (fake)
+        fiber::create("fake console", bench_console);
+
+    fiber::create("console", read_console, 64 * 1024, fiber::priority::low);
 
     while (true)
     {
@@ -0,0 +1,85 @@
+#include "fiber.h"
+
+#include "bt_adapter.h"
+#include "bt_channel.h"
+#include "bt_device.h"
+#include "bt_fake_console.h"
+#include "bt_fake_controller.h"
+
+#include <bluetooth/l2cap.h>
+
+// channels opened and closed on one device, more of them than the device
+// has slots. every connect must find a free cid, and frames for the cids
+// of closed channels must not reach anything, while the one channel still
+// open gets its own
+
+static const usize CHANNELS = 200;
+
+static usize delivered = 0;
+static usize delivered_bytes = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (ok)
+        return;
+
+    printf("failed: %s\n", what);
+    exit(1);
+}
+
+static void run()
+{
+    static bt::fake_controller controller;
+    static bt::adapter hci(bt::adapter::transport{controller.host_fd()});
+    static const bdaddr_t peer = {{0x46, 0xf8, 0x3b, 0xeb, 0x68, 0xdc}};
+
+    check(hci.reset() && hci.read_buffer_size(), "adapter setup");
+
+    // answers the l2cap signalling for psm 0x11
+    bt::fake_console console(controller, peer);
+
+    bt::device dev(hci, peer);
+    check(dev.connect(0xcc18, 0x02, 0x00, 0x00), "create connection");
+    dev.connected.wait();
+    auto handle = controller.link(peer);
+    check(handle != 0, "link up");
+
+    for (usize i = 0; i < CHANNELS; ++i)
+    {
+        bt::channel ch(dev);
+        check(dev.connect(ch, 0x11), "channel connect");
+    }
+
+    bt::channel live(dev);
+    check(dev.connect(live, 0x11), "live channel connect");
+
+    emitter<block>::listener count([](block pkt) {
+        ++delivered;
+        delivered_bytes += pkt.size;
+    }, true);
+    live.data.listen(count);
+
+    // one frame to every cid handed out so far, each one byte long
+    for (u16 cid = 0x0040; cid < 0x0040 + CHANNELS + 8; ++cid)
+    {
+        u8 frame_data[sizeof(l2cap_hdr) + 1] = {};
+        auto hdr = (l2cap_hdr *)frame_data;
+        hdr->len = htobs(1);
+        hdr->cid = htobs(cid);
+        controller.send_acl(handle, block(frame_data, sizeof(frame_data)));
+    }
+
+    fiber::delay(50);
+    check(delivered == 1 && delivered_bytes == 1, "only the live channel gets a frame");
+
+    printf("ok, %zu channels\n", CHANNELS + 1);
+    exit(0);
+}
+
+int main()
+{
+    fiber::create("channels", run);
+
+    while (true)
+        fiber::run();
+}